@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hexdump.h"
+
+/*
+ * Hex dump microbenchmark. Bodies are formatted for the log by the
+ * snprintf() loop write_hex_to_log() used to run, and by each encoder in
+ * hexdump.cpp that the cpu supports. Before timing anything, every encoder
+ * is checked against the snprintf() output on random chunks, with random
+ * lengths and starting indexes.
+ *
+ * Usage: hex_bench [megabytes]
+ */
+
+#define CHUNK 8000 // what put() hands write_hex_to_log() at a time
+
+/*
+ * The formatting of the old write_hex_to_log(), writing into a buffer
+ * instead of one pwrite() per piece
+ */
+static int format_snprintf(char *out, char *content, int bytes_read, int bytes)
+{
+    char *start = out;
+    int lines = bytes_read / 20;
+    if(bytes_read % 20 > 0)
+        lines++;
+
+    int char_cur = 0;
+    for(int i = 0; i < lines; i++) {
+        out += snprintf(out, 12, "%08d ", bytes);
+        int upto = 20;
+        if(i == lines - 1)
+            upto = bytes_read - (20 * i);
+
+        unsigned int byte;
+        for(int j = 0; j < upto; j++) {
+            byte = content[char_cur++];
+            snprintf(out, 3, "%02x", byte); // may be cut short, like before
+            out += strlen(out);
+            if(j < upto - 1)
+                *out++ = ' ';
+        }
+
+        bytes += 20;
+        *out++ = '\n';
+    }
+
+    return out - start;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char body[CHUNK];
+static char expected[CHUNK / 20 * HEXDUMP_LINE_MAX + HEXDUMP_LINE_MAX + HEXDUMP_SLACK];
+static char text[sizeof(expected)];
+
+/*
+ * Compares the encoder in use with snprintf() on random input. Returns the
+ * number of mismatches.
+ */
+static int check(int rounds)
+{
+    int failures = 0;
+    for(int round = 0; round < rounds; round++) {
+        int len = rand() % (CHUNK + 1);
+        int index = rand() % 4 == 0 ? 99999000 + rand() % 2000 : rand() % 1000000;
+        for(int i = 0; i < len; i++)
+            body[i] = rand();
+
+        int expected_len = format_snprintf(expected, body, len, index);
+        int text_len = hexdump_format(text, body, len, index);
+        if(text_len != expected_len || memcmp(text, expected, text_len) != 0) {
+            if(failures++ == 0)
+                fprintf(stderr, "%s: mismatch on %d bytes from index %d\n", hexdump_encoder(), len, index);
+        }
+    }
+    return failures;
+}
+
+static void report(const char *name, double elapsed, long long bytes, long long check_sum)
+{
+    printf("%-10s %8.1f MB/s of body %8.2f ns/byte  (check %lld)\n",
+      name,
+      bytes / elapsed / (1 << 20),
+      elapsed * 1e9 / bytes,
+      check_sum);
+}
+
+int main(int argc, char *argv[])
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    int chunks = (long long)megabytes * (1 << 20) / CHUNK;
+    int failed = 0;
+
+    srand(1);
+    for(int i = 0; i < CHUNK; i++)
+        body[i] = rand();
+
+    // the old formatting as the baseline
+    long long sum = 0;
+    double start = now();
+    for(int i = 0; i < chunks; i++)
+        sum += format_snprintf(text, body, CHUNK, i * CHUNK);
+    report("snprintf", now() - start, (long long)chunks * CHUNK, sum);
+
+    for(int encoder = HEXDUMP_SCALAR; hexdump_use(encoder) == 0; encoder++) {
+        int failures = check(2000);
+        if(failures > 0) {
+            printf("%-10s %d of 2000 random chunks differ from snprintf\n", hexdump_encoder(), failures);
+            failed = 1;
+            continue;
+        }
+
+        sum = 0;
+        start = now();
+        for(int i = 0; i < chunks; i++)
+            sum += hexdump_format(text, body, CHUNK, i * CHUNK);
+        report(hexdump_encoder(), now() - start, (long long)chunks * CHUNK, sum);
+    }
+
+    return failed;
+}
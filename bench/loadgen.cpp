@@ -0,0 +1,454 @@
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Load generator for the server. Every connection gets a thread of its own
+ * that sends a mix of GETs and PUTs of a set of objects for a while, one
+ * request at a time, and times each of them from the first byte sent to
+ * the last byte of the response received. The objects are PUT once before
+ * the clock starts, so every GET finds its file.
+ *
+ * At the end the throughput and the p50, p99 and p999 latencies are
+ * printed. With -j the same numbers are appended as one line of JSON to a
+ * file, so the results of several runs can be collected and compared.
+ *
+ * Usage: loadgen [-c connections] [-d seconds] [-g GET percent]
+ *                [-s object size] [-o objects] [-x] [-j file] [-L label]
+ *                host port
+ *
+ * The object size takes a k or m suffix. -x closes the connection after
+ * every request instead of keeping it alive.
+ */
+
+#define NAME_LEN 27
+#define HEAD_SIZE 8192
+
+struct options {
+    int connections;
+    double seconds;
+    int get_percent;
+    long object_size;
+    int objects;
+    int keep_alive;
+    const char *json;
+    const char *label;
+    struct addrinfo *server;
+};
+
+// what one connection's thread did
+struct client {
+    pthread_t thread;
+    const struct options *opt;
+    unsigned seed;
+    unsigned long long *latencies; // ns of every completed request
+    long count;
+    long capacity;
+    long gets;
+    long puts;
+    long errors;
+    long reconnects;
+    unsigned long long bytes; // body bytes sent and received
+};
+
+static char *body; // what every PUT sends
+static double deadline;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void object_name(char *name, int index)
+{
+    snprintf(name, NAME_LEN + 1, "loadgen%020d", index);
+}
+
+static int connect_server(const struct options *opt)
+{
+    int fd = socket(opt->server->ai_family, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, opt->server->ai_addr, opt->server->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // a request goes out with one write anyway, don't let it wait for acks
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, long len)
+{
+    while(len > 0) {
+        ssize_t bytes_written = write(fd, buf, len);
+        if(bytes_written < 0 && errno == EINTR)
+            continue;
+        if(bytes_written <= 0)
+            return -1;
+        buf += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+/*
+ * Reads one response and throws its body away. Returns the status code,
+ * or -1 if the connection failed. *closing is set when the server is
+ * going to close the connection.
+ */
+static int read_response(int fd, int *closing, unsigned long long *bytes)
+{
+    char head[HEAD_SIZE + 1];
+    int len = 0;
+    char *end = NULL;
+    while(end == NULL) {
+        if(len == HEAD_SIZE)
+            return -1;
+        ssize_t bytes_read = read(fd, head + len, HEAD_SIZE - len);
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+        if(bytes_read <= 0)
+            return -1;
+        len += bytes_read;
+        head[len] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+
+    int status;
+    if(sscanf(head, "HTTP/1.1 %d", &status) != 1)
+        return -1;
+
+    // the header names are the server's own, so their case is known
+    long content_length = 0;
+    char *field = strstr(head, "\r\nContent-Length: ");
+    if(field != NULL && field < end)
+        content_length = atol(field + 18);
+    field = strstr(head, "\r\nConnection: close");
+    *closing = field != NULL && field < end;
+
+    long received = len - (end + 4 - head);
+    *bytes += content_length;
+    char scratch[65536];
+    while(received < content_length) {
+        long want = content_length - received < (long)sizeof(scratch) ? content_length - received : sizeof(scratch);
+        ssize_t bytes_read = read(fd, scratch, want);
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+        if(bytes_read <= 0)
+            return -1;
+        received += bytes_read;
+    }
+
+    return status;
+}
+
+/*
+ * Sends one request on *fd, connecting first if needed, and waits for the
+ * response. Returns the status code or -1.
+ */
+static int request(struct client *client, int *fd, int put, const char *name)
+{
+    const struct options *opt = client->opt;
+    char head[256];
+    int head_len;
+    if(put)
+        head_len = snprintf(head,
+          sizeof(head),
+          "PUT %s HTTP/1.1\r\nContent-Length: %ld\r\n%s\r\n",
+          name,
+          opt->object_size,
+          opt->keep_alive ? "" : "Connection: close\r\n");
+    else
+        head_len = snprintf(
+          head, sizeof(head), "GET %s HTTP/1.1\r\n%s\r\n", name, opt->keep_alive ? "" : "Connection: close\r\n");
+
+    if(*fd < 0) {
+        *fd = connect_server(opt);
+        if(*fd < 0)
+            return -1;
+        client->reconnects++;
+    }
+
+    int closing = 1;
+    int status = -1;
+    if(send_all(*fd, head, head_len) == 0 && (!put || send_all(*fd, body, opt->object_size) == 0))
+        status = read_response(*fd, &closing, &client->bytes);
+    if(put && status > 0)
+        client->bytes += opt->object_size;
+
+    if(status < 0 || closing) {
+        close(*fd);
+        *fd = -1;
+    }
+    return status;
+}
+
+static void record(struct client *client, unsigned long long ns)
+{
+    if(client->count == client->capacity) {
+        client->capacity = client->capacity ? client->capacity * 2 : 65536;
+        client->latencies = (unsigned long long *)realloc(client->latencies, client->capacity * sizeof(ns));
+        if(client->latencies == NULL)
+            err(1, "realloc");
+    }
+    client->latencies[client->count++] = ns;
+}
+
+static void *run_client(void *arg)
+{
+    struct client *client = (struct client *)arg;
+    const struct options *opt = client->opt;
+    char name[NAME_LEN + 1];
+    int fd = -1;
+
+    while(now() < deadline) {
+        int put = (int)(rand_r(&client->seed) % 100) >= opt->get_percent;
+        object_name(name, rand_r(&client->seed) % opt->objects);
+
+        unsigned long long start = now_ns();
+        int status = request(client, &fd, put, name);
+        unsigned long long ns = now_ns() - start;
+
+        if(status != 200 && status != 201) {
+            client->errors++;
+            continue;
+        }
+        record(client, ns);
+        if(put)
+            client->puts++;
+        else
+            client->gets++;
+    }
+
+    if(fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const unsigned long long *sorted, long count, double fraction)
+{
+    if(count == 0)
+        return 0;
+    long rank = (long)(count * fraction);
+    if(rank >= count)
+        rank = count - 1;
+    return sorted[rank] / 1e3;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+      "Usage: %s [-c connections] [-d seconds] [-g GET percent] [-s object size] [-o objects] [-x] [-j file] [-L "
+      "label] host port\n",
+      program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct options opt;
+    opt.connections = 16;
+    opt.seconds = 10;
+    opt.get_percent = 90;
+    opt.object_size = 4096;
+    opt.objects = 100;
+    opt.keep_alive = 1;
+    opt.json = NULL;
+    opt.label = "";
+
+    int c;
+    char *suffix;
+    while((c = getopt(argc, argv, "c:d:g:s:o:xj:L:")) != -1) {
+        switch(c) {
+            case 'c':
+                opt.connections = atoi(optarg);
+                break;
+            case 'd':
+                opt.seconds = atof(optarg);
+                break;
+            case 'g':
+                opt.get_percent = atoi(optarg);
+                break;
+            case 's':
+                opt.object_size = strtol(optarg, &suffix, 10);
+                if(*suffix == 'k' || *suffix == 'K')
+                    opt.object_size <<= 10;
+                else if(*suffix == 'm' || *suffix == 'M')
+                    opt.object_size <<= 20;
+                break;
+            case 'o':
+                opt.objects = atoi(optarg);
+                break;
+            case 'x':
+                opt.keep_alive = 0;
+                break;
+            case 'j':
+                opt.json = optarg;
+                break;
+            case 'L':
+                opt.label = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 2 != argc || opt.connections <= 0 || opt.objects <= 0 || opt.object_size < 0 || opt.get_percent < 0
+       || opt.get_percent > 100)
+        usage(argv[0]);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(argv[optind], argv[optind + 1], &hints, &opt.server);
+    if(status != 0)
+        errx(1, "getaddrinfo: %s", gai_strerror(status));
+
+    body = (char *)malloc(opt.object_size + 1);
+    if(body == NULL)
+        err(1, "malloc");
+    for(long i = 0; i < opt.object_size; i++)
+        body[i] = 'a' + i % 26;
+
+    // every object exists before the first GET
+    struct client setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.opt = &opt;
+    int fd = -1;
+    char name[NAME_LEN + 1];
+    for(int i = 0; i < opt.objects; i++) {
+        object_name(name, i);
+        if(request(&setup, &fd, 1, name) != 201)
+            errx(1, "could not PUT %s", name);
+    }
+    if(fd >= 0)
+        close(fd);
+
+    struct client *clients = (struct client *)calloc(opt.connections, sizeof(struct client));
+    if(clients == NULL)
+        err(1, "calloc");
+    double start = now();
+    deadline = start + opt.seconds;
+    for(int i = 0; i < opt.connections; i++) {
+        clients[i].opt = &opt;
+        clients[i].seed = 0x9e3779b9u * (i + 1);
+        if(pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0)
+            err(1, "pthread_create");
+    }
+
+    long count = 0, gets = 0, puts = 0, errors = 0, reconnects = 0;
+    unsigned long long bytes = 0;
+    for(int i = 0; i < opt.connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        count += clients[i].count;
+        gets += clients[i].gets;
+        puts += clients[i].puts;
+        errors += clients[i].errors;
+        reconnects += clients[i].reconnects;
+        bytes += clients[i].bytes;
+    }
+    double wall = now() - start;
+
+    unsigned long long *all = (unsigned long long *)malloc((count ? count : 1) * sizeof(unsigned long long));
+    if(all == NULL)
+        err(1, "malloc");
+    long filled = 0;
+    unsigned long long total_ns = 0;
+    for(int i = 0; i < opt.connections; i++) {
+        memcpy(all + filled, clients[i].latencies, clients[i].count * sizeof(unsigned long long));
+        filled += clients[i].count;
+        free(clients[i].latencies);
+    }
+    for(long i = 0; i < count; i++)
+        total_ns += all[i];
+    qsort(all, count, sizeof(unsigned long long), compare_ns);
+
+    double rps = count / wall;
+    double mbps = bytes / wall / (1 << 20);
+    double mean = count ? total_ns / 1e3 / count : 0;
+    double p50 = percentile_us(all, count, 0.5);
+    double p99 = percentile_us(all, count, 0.99);
+    double p999 = percentile_us(all, count, 0.999);
+    double max = count ? all[count - 1] / 1e3 : 0;
+
+    printf("%d connections, %d%% GET, %ld byte objects x %d, %s, %.1f s\n",
+      opt.connections,
+      opt.get_percent,
+      opt.object_size,
+      opt.objects,
+      opt.keep_alive ? "keep-alive" : "one request per connection",
+      wall);
+    printf("%ld requests (%ld GET, %ld PUT), %ld errors, %ld connections opened\n",
+      count,
+      gets,
+      puts,
+      errors,
+      reconnects);
+    printf("%.0f requests/s, %.1f MB/s of bodies\n", rps, mbps);
+    printf("latency mean %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n", mean, p50, p99, p999, max);
+
+    if(opt.json != NULL) {
+        FILE *out = fopen(opt.json, "a");
+        if(out == NULL)
+            err(1, "%s", opt.json);
+        fprintf(out,
+          "{\"label\": \"%s\", \"connections\": %d, \"seconds\": %.3f, \"get_percent\": %d, \"object_size\": %ld, "
+          "\"objects\": %d, \"keep_alive\": %s, \"requests\": %ld, \"gets\": %ld, \"puts\": %ld, \"errors\": %ld, "
+          "\"connects\": %ld, \"requests_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"latency_us\": {\"mean\": %.1f, "
+          "\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+          opt.label,
+          opt.connections,
+          wall,
+          opt.get_percent,
+          opt.object_size,
+          opt.objects,
+          opt.keep_alive ? "true" : "false",
+          count,
+          gets,
+          puts,
+          errors,
+          reconnects,
+          rps,
+          mbps,
+          mean,
+          p50,
+          p99,
+          p999,
+          max);
+        fclose(out);
+    }
+
+    free(all);
+    free(clients);
+    free(body);
+    freeaddrinfo(opt.server);
+    return errors > 0 && count == 0;
+}
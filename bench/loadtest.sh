@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs bench/loadgen against a fresh server with a few standard mixes and
+# appends the results to a JSON lines file, one line per mix, labelled
+# with the current commit. Extra server options can be passed in
+# SERVER_ARGS, e.g. SERVER_ARGS="-e -C 64" make loadtest.
+#
+# Usage: bench/loadtest.sh [results file] [seconds per mix]
+
+set -e
+
+results=${1:-loadtest.jsonl}
+seconds=${2:-5}
+port=${PORT:-8137}
+top=$(cd "$(dirname "$0")/.." && pwd)
+commit=$(git -C "$top" rev-parse --short HEAD 2>/dev/null || echo unknown)
+case $results in /*) ;; *) results=$(pwd)/$results ;; esac
+
+dir=$(mktemp -d)
+cd "$dir"
+"$top/httpserver" -K 1000000 $SERVER_ARGS 127.0.0.1 "$port" >/dev/null 2>&1 &
+server=$!
+trap 'kill -INT $server 2>/dev/null; wait $server 2>/dev/null; cd /; rm -rf "$dir"' EXIT
+sleep 0.5
+
+run() {
+    label=$1
+    shift
+    "$top/bench/loadgen" -d "$seconds" -j "$results" -L "$commit $label $SERVER_ARGS" "$@" 127.0.0.1 "$port"
+    echo
+}
+
+run get-4k -g 100 -s 4k -c 16
+run mixed-4k -g 90 -s 4k -c 16
+run put-1m -g 0 -s 1m -c 4 -o 16
+run get-4k-close -g 100 -s 4k -c 16 -x
+
+echo "results appended to $results"
@@ -0,0 +1,164 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hexdump.h"
+#include "methods.h"
+
+/*
+ * Golden file check of the PUT body log. A body of every byte value
+ * repeated past 64 KB is handed to write_hex_to_log() in chunks of fixed,
+ * uneven sizes, and the log it leaves is compared byte for byte with
+ * bench/logcheck.golden. That file was recorded with the write_hex_to_log()
+ * that did one pwrite() per line index and per byte, so this shows the
+ * batched writes and the encoders still log exactly what it did, down to
+ * bytes from 0x80 up coming out as "ff". The check is run with every
+ * encoder in hexdump.cpp that the cpu supports.
+ *
+ * The server itself splits a body wherever its reads happen to end, which
+ * is why the chunks are fed here instead of through a socket.
+ *
+ * Usage: logcheck [-r] golden
+ *   -r  record the golden file instead of checking against it
+ */
+
+// what httpserver.cpp would otherwise define for the server
+int log_offset;
+int log_fd = -1;
+int log_binary;
+int event_mode;
+int max_requests;
+int idle_timeout;
+int header_timeout;
+int body_timeout;
+int send_timeout;
+int uring_mode;
+long long direct_threshold;
+int stats_endpoint;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t listening = 1;
+
+#define ROUNDS 257 // of the bytes 0 to 255, 65792 bytes in all
+
+// sizes of the chunks in turn, around the 20 bytes of a line and the 8000
+// of a read
+static const int chunk_sizes[] = { 7919, 1, 19, 20, 21, 8000, 3333 };
+
+/*
+ * Logs the body the way put() does and returns the length of the log
+ */
+static int log_body_in_chunks(const char *path)
+{
+    static char body[ROUNDS * 256];
+    for(int i = 0; i < (int)sizeof(body); i++)
+        body[i] = (char)i;
+
+    log_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(log_fd < 0) {
+        perror(path);
+        exit(2);
+    }
+
+    int offset = 0, total = 0, turn = 0;
+    while(total < (int)sizeof(body)) {
+        int len = chunk_sizes[turn++ % (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))];
+        if(len > (int)sizeof(body) - total)
+            len = sizeof(body) - total;
+        total += len;
+        offset = write_hex_to_log(len, total, offset, body + total - len);
+        if(offset < 0) {
+            fprintf(stderr, "write_hex_to_log failed after %d bytes\n", total);
+            exit(2);
+        }
+    }
+
+    close(log_fd);
+    return offset;
+}
+
+static char *read_file(const char *path, long *size)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) {
+        perror(path);
+        exit(2);
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    char *data = (char *)malloc(*size + 1);
+    if(data == NULL || fread(data, 1, *size, file) != (size_t)*size) {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(2);
+    }
+    fclose(file);
+    data[*size] = '\0';
+    return data;
+}
+
+/*
+ * Logs the body with the encoder in use and compares the log with the
+ * golden file. Returns 0 if they are the same.
+ */
+static int check(const char *golden)
+{
+    char path[] = "/tmp/logcheck.XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        perror("mkstemp");
+        exit(2);
+    }
+    close(fd);
+    log_body_in_chunks(path);
+
+    long want_len, got_len;
+    char *want = read_file(golden, &want_len);
+    char *got = read_file(path, &got_len);
+    unlink(path);
+
+    long same = 0;
+    while(same < want_len && same < got_len && want[same] == got[same])
+        same++;
+    int status = 0;
+    if(same == want_len && same == got_len) {
+        printf("%s: log matches %s, %ld bytes\n", hexdump_encoder(), golden, want_len);
+    } else {
+        // show the line where they part
+        long line = same;
+        while(line > 0 && want[line - 1] != '\n')
+            line--;
+        printf("%s: log differs from %s at byte %ld of %ld (got %ld)\n", hexdump_encoder(), golden, same, want_len, got_len);
+        printf("want: %.*s\n", (int)strcspn(want + line, "\n"), want + line);
+        printf("got:  %.*s\n", got_len > line ? (int)strcspn(got + line, "\n") : 0, got + line);
+        status = 1;
+    }
+
+    free(want);
+    free(got);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    int record = argc == 3 && strcmp(argv[1], "-r") == 0;
+    if(argc != 2 && !record) {
+        fprintf(stderr, "Usage: %s [-r] golden\n", argv[0]);
+        return 2;
+    }
+    const char *golden = argv[argc - 1];
+
+    if(record) {
+        int len = log_body_in_chunks(golden);
+        printf("recorded %d bytes of log in %s\n", len, golden);
+        return 0;
+    }
+
+    int status = 0;
+    for(int encoder = HEXDUMP_SCALAR; hexdump_use(encoder) == 0; encoder++)
+        status |= check(golden);
+    return status;
+}
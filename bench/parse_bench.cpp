@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser.h"
+
+/*
+ * Parse throughput microbenchmark. The same request head is parsed over and
+ * over by the state machine in parser.cpp and by the nested strtok_r
+ * tokenizer that accept_job() used before it, which is kept below. The
+ * parser is also run with the head arriving one byte at a time, which the
+ * tokenizer cannot handle at all.
+ *
+ * Usage: parse_bench [iterations]
+ */
+
+static const char request[] = "PUT abcdefghijklmnopqrstuvwxyz0 HTTP/1.1\r\n"
+                              "Host: localhost:8080\r\n"
+                              "User-Agent: curl/7.68.0\r\n"
+                              "Accept: */*\r\n"
+                              "Content-Length: 12345\r\n"
+                              "Connection: keep-alive\r\n"
+                              "Expect: 100-continue\r\n"
+                              "\r\n";
+
+/*
+ * The tokenizer from the old accept_job(). It works on a copy because
+ * strtok_r() writes into the buffer.
+ */
+static int tokenize(char *buf, char **resource)
+{
+    char *token1 = NULL;
+    char *saveptr1;
+    token1 = strtok_r(buf, "\r\n", &saveptr1);
+
+    int content_length = -1;
+    *resource = NULL;
+
+    while(token1 != NULL) {
+        char *token2 = NULL;
+        char *saveptr2;
+        token2 = strtok_r(token1, " ", &saveptr2);
+        while(token2 != NULL) {
+            if(!strcmp(token2, "GET") || !strcmp(token2, "PUT")) {
+                *resource = strtok_r(NULL, " ", &saveptr2);
+            }
+
+            if(!strcmp(token2, "Content-Length:")) {
+                content_length = atoi(strtok_r(NULL, " ", &saveptr2));
+            }
+
+            token2 = strtok_r(NULL, " ", &saveptr2);
+        }
+
+        token1 = strtok_r(NULL, "\r\n", &saveptr1);
+    }
+
+    return content_length;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed, int iterations, long long check)
+{
+    int len = sizeof(request) - 1;
+    printf("%-22s %8.1f ns/request %8.1f MB/s  (check %lld)\n",
+      name,
+      elapsed * 1e9 / iterations,
+      (double)len * iterations / elapsed / (1 << 20),
+      check);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000000;
+    int len = sizeof(request) - 1;
+    char buf[sizeof(request)];
+    long long check;
+    double start;
+
+    printf("%d byte request head, %d iterations\n", len, iterations);
+
+    check = 0;
+    start = now();
+    for(int i = 0; i < iterations; i++) {
+        char *resource;
+        memcpy(buf, request, sizeof(request));
+        check += tokenize(buf, &resource);
+        check += resource != NULL;
+    }
+    report("strtok tokenizer", now() - start, iterations, check);
+
+    check = 0;
+    start = now();
+    for(int i = 0; i < iterations; i++) {
+        struct http_parser parser;
+        parser_init(&parser);
+        if(parser_execute(&parser, request, len) != PARSE_DONE)
+            return 1;
+        check += parser.req.content_length + (parser.req.resource.len > 0);
+    }
+    report("parser", now() - start, iterations, check);
+
+    check = 0;
+    start = now();
+    for(int i = 0; i < iterations / 10; i++) {
+        struct http_parser parser;
+        parser_init(&parser);
+        int status = PARSE_AGAIN;
+        for(int n = 1; n <= len && status == PARSE_AGAIN; n++)
+            status = parser_execute(&parser, request, n);
+        if(status != PARSE_DONE)
+            return 1;
+        check += parser.req.content_length + (parser.req.resource.len > 0);
+    }
+    report("parser, 1 byte/read", now() - start, iterations / 10, check);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue.h"
+
+/*
+ * Contention microbenchmark for the connection queue. A number of producer
+ * threads push fds through the queue to a number of consumer threads, which
+ * stop when they receive the -2 poison pill, the same way the server shuts
+ * down its workers. The lock-free ring in queue.cpp is compared against the
+ * malloc'd linked list with one mutex and condition variable that it
+ * replaced, which is kept below.
+ *
+ * Usage: queue_bench [producers] [consumers] [items per producer]
+ */
+
+struct legacy_node {
+    int fd;
+    struct legacy_node *next;
+};
+
+struct legacy_queue {
+    struct legacy_node *first;
+    struct legacy_node *last;
+    pthread_mutex_t mutex;
+    pthread_cond_t condl;
+};
+
+static void legacy_enqueue(struct legacy_queue *queue, int fd)
+{
+    struct legacy_node *new_node = (struct legacy_node *)malloc(sizeof(struct legacy_node));
+    new_node->fd = fd;
+    new_node->next = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if(queue->last == NULL) {
+        queue->first = new_node;
+        queue->last = new_node;
+    } else {
+        queue->last->next = new_node;
+        queue->last = new_node;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_cond_signal(&queue->condl);
+}
+
+static int legacy_dequeue(struct legacy_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while(queue->first == NULL)
+        pthread_cond_wait(&queue->condl, &queue->mutex);
+
+    struct legacy_node *tmp = queue->first;
+    int fd = tmp->fd;
+    queue->first = tmp->next;
+    if(queue->first == NULL)
+        queue->last = NULL;
+    pthread_mutex_unlock(&queue->mutex);
+    free(tmp);
+    return fd;
+}
+
+static int items_per_producer;
+static struct queue *ring;
+static struct legacy_queue legacy;
+
+static void *ring_producer(void *)
+{
+    for(int i = 0; i < items_per_producer; i++)
+        enqueue(ring, i);
+    return NULL;
+}
+
+static void *ring_consumer(void *)
+{
+    while(dequeue(ring) != -2)
+        ;
+    return NULL;
+}
+
+static void *legacy_producer(void *)
+{
+    for(int i = 0; i < items_per_producer; i++)
+        legacy_enqueue(&legacy, i);
+    return NULL;
+}
+
+static void *legacy_consumer(void *)
+{
+    while(legacy_dequeue(&legacy) != -2)
+        ;
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name,
+  int producers,
+  int consumers,
+  void *(*producer)(void *),
+  void *(*consumer)(void *),
+  void (*poison)(int))
+{
+    pthread_t *threads = (pthread_t *)malloc((producers + consumers) * sizeof(pthread_t));
+
+    double start = now();
+    for(int i = 0; i < consumers; i++)
+        pthread_create(&threads[i], NULL, consumer, NULL);
+    for(int i = 0; i < producers; i++)
+        pthread_create(&threads[consumers + i], NULL, producer, NULL);
+
+    for(int i = 0; i < producers; i++)
+        pthread_join(threads[consumers + i], NULL);
+    for(int i = 0; i < consumers; i++)
+        poison(-2);
+    for(int i = 0; i < consumers; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    double items = (double)producers * items_per_producer;
+    printf("%-12s %8.2f M items/s %8.1f ns/item\n", name, items / elapsed / 1e6, elapsed * 1e9 / items);
+    free(threads);
+}
+
+static void ring_poison(int fd)
+{
+    enqueue(ring, fd);
+}
+
+static void legacy_poison(int fd)
+{
+    legacy_enqueue(&legacy, fd);
+}
+
+int main(int argc, char *argv[])
+{
+    int producers = argc > 1 ? atoi(argv[1]) : 4;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    items_per_producer = argc > 3 ? atoi(argv[3]) : 1000000;
+
+    // the ring is as large as the server's default
+    ring = new_queue(1024);
+    legacy.first = legacy.last = NULL;
+    pthread_mutex_init(&legacy.mutex, NULL);
+    pthread_cond_init(&legacy.condl, NULL);
+
+    printf("%d producers, %d consumers, %d items each\n", producers, consumers, items_per_producer);
+    run("mutex list", producers, consumers, legacy_producer, legacy_consumer, legacy_poison);
+    run("lock-free", producers, consumers, ring_producer, ring_consumer, ring_poison);
+
+    free_queue(ring);
+    return 0;
+}
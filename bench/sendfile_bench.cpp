@@ -0,0 +1,157 @@
+#include <arpa/inet.h>
+#include <err.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Compares the two ways get() can send a file to a client: the read()/write()
+ * loop through an 8000 byte buffer and sendfile(). Each path pushes the same
+ * cached file over a loopback TCP connection and reports its throughput and
+ * the CPU time the sending thread spent per GB.
+ *
+ * Usage: sendfile_bench [megabytes] [rounds]
+ */
+
+#define BUF_SIZE 8000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * CPU time (user + system) used by the calling thread
+ */
+static double thread_cpu()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec
+           + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Reads and discards everything the sender writes
+ */
+static void *drain(void *arg)
+{
+    int fd = *(int *)arg;
+    static char buf[1 << 16];
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/*
+ * Returns a connected loopback TCP pair in fds[0] (sender) and fds[1]
+ */
+static void tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, len) < 0
+       || listen(listen_fd, 1) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0)
+        err(1, "listen");
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(fds[0], (struct sockaddr *)&addr, len) < 0)
+        err(1, "connect");
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if(fds[1] < 0)
+        err(1, "accept");
+    close(listen_fd);
+}
+
+static void send_copy(int fd, int filefd, off_t length)
+{
+    char buf[BUF_SIZE];
+    off_t offset = 0;
+    lseek(filefd, 0, SEEK_SET);
+    while(offset < length) {
+        int bytes_read = read(filefd, buf, BUF_SIZE);
+        if(bytes_read <= 0)
+            err(1, "read");
+        if(write(fd, buf, bytes_read) != bytes_read)
+            err(1, "write");
+        offset += bytes_read;
+    }
+}
+
+static void send_zero_copy(int fd, int filefd, off_t length)
+{
+    off_t offset = 0;
+    while(offset < length) {
+        if(sendfile(fd, filefd, &offset, length - offset) <= 0)
+            err(1, "sendfile");
+    }
+}
+
+static void run(const char *name, void (*send)(int, int, off_t), int filefd, off_t length, int rounds)
+{
+    double wall = 0, cpu = 0;
+    for(int i = 0; i < rounds; i++) {
+        int fds[2];
+        pthread_t reader;
+        tcp_pair(fds);
+        pthread_create(&reader, NULL, drain, &fds[1]);
+
+        double start_wall = now(), start_cpu = thread_cpu();
+        send(fds[0], filefd, length);
+        shutdown(fds[0], SHUT_WR);
+        pthread_join(reader, NULL);
+        wall += now() - start_wall;
+        cpu += thread_cpu() - start_cpu;
+
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    double gb = (double)length * rounds / (1 << 30);
+    printf("%-12s %10.1f MB/s %10.1f CPU ms/GB\n", name, gb * 1024 / wall, cpu * 1000 / gb);
+}
+
+int main(int argc, char *argv[])
+{
+    off_t megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    off_t length = megabytes << 20;
+
+    char path[] = "/tmp/sendfile_bench.XXXXXX";
+    int filefd = mkstemp(path);
+    if(filefd < 0)
+        err(1, "mkstemp");
+    unlink(path);
+
+    // fill the file once so both paths read it from the page cache
+    char buf[1 << 16];
+    for(size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)i;
+    for(off_t written = 0; written < length; written += sizeof(buf)) {
+        if(write(filefd, buf, sizeof(buf)) != sizeof(buf))
+            err(1, "write");
+    }
+
+    printf("%lld MB x %d rounds over loopback TCP\n", (long long)megabytes, rounds);
+    run("read/write", send_copy, filefd, length, rounds);
+    run("sendfile", send_zero_copy, filefd, length, rounds);
+
+    close(filefd);
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <arpa/inet.h>
+#include <err.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hexdump.h"
+#include "uring.h"
+
+/*
+ * Counts the system calls a logged PUT takes with plain system calls and
+ * with the io_uring backend (-U). Request bodies arrive over a loopback
+ * TCP connection and are stored in a file and hex dumped to a log, chunk by
+ * chunk like put() does. The plain path makes a read(), a write() and a
+ * pwrite() per chunk, the ring submits the writes of a chunk together with
+ * the receive of the next.
+ *
+ * Usage: uring_bench [kilobytes per request] [requests]
+ */
+
+#define BUF_SIZE 8000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns a connected loopback TCP pair in fds[0] (sender) and fds[1]
+ */
+static void tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, len) < 0
+       || listen(listen_fd, 1) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0)
+        err(1, "listen");
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(fds[0], (struct sockaddr *)&addr, len) < 0)
+        err(1, "connect");
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if(fds[1] < 0)
+        err(1, "accept");
+    close(listen_fd);
+}
+
+struct sender {
+    int fd;
+    long long bytes;
+};
+
+/*
+ * Sends the bodies of all requests back to back
+ */
+static void *send_bodies(void *arg)
+{
+    struct sender *sender = (struct sender *)arg;
+    static char buf[1 << 16];
+    memset(buf, 0x5a, sizeof(buf));
+    for(long long sent = 0; sent < sender->bytes;) {
+        long long len = sender->bytes - sent < (long long)sizeof(buf) ? sender->bytes - sent : sizeof(buf);
+        ssize_t bytes_written = write(sender->fd, buf, len);
+        if(bytes_written <= 0)
+            err(1, "write");
+        sent += bytes_written;
+    }
+    return NULL;
+}
+
+static int temp_file()
+{
+    char name[] = "/tmp/uring_bench.XXXXXX";
+    int fd = mkstemp(name);
+    if(fd < 0)
+        err(1, "mkstemp");
+    unlink(name);
+    return fd;
+}
+
+/*
+ * The loop put() runs without the ring. Returns the system calls it made.
+ */
+static long long put_plain(int sock, int filefd, int logfd, int length, off_t *log_offset)
+{
+    static char buf[BUF_SIZE];
+    static char text[BUF_SIZE / 20 * HEXDUMP_LINE_MAX + HEXDUMP_LINE_MAX + HEXDUMP_SLACK];
+    long long calls = 0;
+
+    for(int received = 0; received < length;) {
+        int want = length - received < BUF_SIZE ? length - received : BUF_SIZE;
+        int bytes_read = read(sock, buf, want);
+        if(bytes_read <= 0)
+            err(1, "read");
+        received += bytes_read;
+        if(write(filefd, buf, bytes_read) != bytes_read)
+            err(1, "write");
+        int text_len = hexdump_format(text, buf, bytes_read, received - bytes_read);
+        if(pwrite(logfd, text, text_len, *log_offset) != text_len)
+            err(1, "pwrite");
+        *log_offset += text_len;
+        calls += 3;
+    }
+
+    return calls;
+}
+
+/*
+ * The loop recv_file_uring() in methods.cpp runs. Returns the system calls
+ * it made.
+ */
+static long long put_uring(int sock, int filefd, int length, off_t *log_offset, off_t *file_offset)
+{
+    char *chunk[2] = { uring_buffer(0), uring_buffer(1) };
+    char *text = uring_buffer(2);
+    unsigned long long enters = uring_enters();
+    int results[4];
+    int current = 0, bytes_read = 0, received = 0;
+
+    for(;;) {
+        int ops = 0, recv_op = -1;
+        if(bytes_read > 0) {
+            uring_write_fixed(filefd, current, chunk[current], bytes_read, *file_offset);
+            int text_len = hexdump_format(text, chunk[current], bytes_read, received - bytes_read);
+            uring_write_log(2, text, text_len, *log_offset);
+            *file_offset += bytes_read;
+            *log_offset += text_len;
+            ops += 2;
+        }
+
+        int next = 1 - current;
+        if(received < length) {
+            int want = length - received < BUF_SIZE ? length - received : BUF_SIZE;
+            uring_recv(sock, chunk[next], want);
+            recv_op = ops++;
+        }
+
+        if(uring_submit(results) < 0)
+            err(1, "io_uring");
+        for(int i = 0; i < ops; i++) {
+            if(results[i] <= 0)
+                errx(1, "operation %d failed: %s", i, strerror(-results[i]));
+        }
+
+        if(recv_op < 0)
+            break;
+        bytes_read = results[recv_op];
+        received += bytes_read;
+        current = next;
+    }
+
+    return uring_enters() - enters;
+}
+
+int main(int argc, char *argv[])
+{
+    int length = (argc > 1 ? atoi(argv[1]) : 1024) * 1024;
+    int requests = argc > 2 ? atoi(argv[2]) : 200;
+
+    for(int mode = 0; mode < 2; mode++) {
+        int fds[2];
+        tcp_pair(fds);
+        int filefd = temp_file();
+        int logfd = temp_file();
+
+        if(mode == 1 && uring_init(logfd) < 0) {
+            warn("io_uring");
+            break;
+        }
+
+        struct sender sender = { fds[0], (long long)length * requests };
+        pthread_t thread;
+        pthread_create(&thread, NULL, send_bodies, &sender);
+
+        long long calls = 0;
+        off_t log_offset = 0, file_offset = 0;
+        double start = now();
+        for(int i = 0; i < requests; i++) {
+            if(mode == 0)
+                calls += put_plain(fds[1], filefd, logfd, length, &log_offset);
+            else
+                calls += put_uring(fds[1], filefd, length, &log_offset, &file_offset);
+        }
+        double elapsed = now() - start;
+
+        printf("%-8s %8.1f syscalls/request %8.1f requests/s %8.1f MB/s of body\n",
+          mode == 0 ? "plain" : "io_uring",
+          (double)calls / requests,
+          requests / elapsed,
+          (double)length * requests / elapsed / (1 << 20));
+
+        pthread_join(thread, NULL);
+        uring_exit();
+        close(fds[0]);
+        close(fds[1]);
+        close(filefd);
+        close(logfd);
+    }
+
+    return 0;
+}
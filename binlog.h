@@ -0,0 +1,18 @@
+#include <stdint.h>
+
+/*
+ * Record of the binary log written with -b. Each entry of the text log is
+ * one record, followed by the resource name and then the raw body of a
+ * PUT. Fields are in the byte order of the machine running the server.
+ */
+
+#define BINLOG_MAGIC 0x31474c48 // "HLG1"
+
+struct binlog_record {
+    uint32_t magic;
+    uint16_t status;       // 0 if the request was served, else the error response
+    uint16_t resource_len; // bytes of resource name after the record
+    char method[8];        // null padded
+    int64_t length;        // bytes of body after the resource name
+    int64_t timestamp;     // nanoseconds since the epoch
+};
@@ -0,0 +1,155 @@
+#include "chunked.h"
+
+// states of the decoder, in the order they are normally passed through
+enum {
+    C_SIZE,
+    C_EXTENSION,
+    C_SIZE_LF,
+    C_DATA,
+    C_DATA_CR,
+    C_DATA_LF,
+    C_TRAILER_START,
+    C_TRAILER,
+    C_TRAILER_LF,
+    C_END_LF,
+    C_DONE
+};
+
+/*
+ * Prepare a decoder for a new body
+ */
+void chunked_init(struct chunked_decoder *decoder)
+{
+    decoder->state = C_SIZE;
+    decoder->remaining = 0;
+    decoder->digits = 0;
+}
+
+static int hex_value(char ch)
+{
+    if(ch >= '0' && ch <= '9')
+        return ch - '0';
+    if(ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Looks at the next len bytes of a chunked body. It stops after the first
+ * run of body bytes it finds, whose place in in is stored in *data_start
+ * and *data_len (0 if there was none), so the caller can write them out
+ * before calling again with the rest. Returns how many bytes of in were
+ * used, or -1 if the body is malformed. Chunk extensions and trailers are
+ * skipped, and a bare LF is accepted wherever CRLF belongs.
+ */
+int chunked_decode(struct chunked_decoder *decoder, const char *in, int len, int *data_start, int *data_len)
+{
+    int state = decoder->state;
+    int pos = 0;
+    *data_start = *data_len = 0;
+
+    while(pos < len && state != C_DONE) {
+        if(state == C_DATA) {
+            int available = len - pos;
+            int take = decoder->remaining < available ? (int)decoder->remaining : available;
+            *data_start = pos;
+            *data_len = take;
+            pos += take;
+            decoder->remaining -= take;
+            if(decoder->remaining == 0)
+                state = C_DATA_CR;
+            break;
+        }
+
+        char ch = in[pos++];
+        switch(state) {
+            case C_SIZE:
+                if(hex_value(ch) >= 0) {
+                    if(++decoder->digits > 15) // keeps the size from overflowing
+                        return -1;
+                    decoder->remaining = decoder->remaining * 16 + hex_value(ch);
+                } else if(decoder->digits == 0) {
+                    return -1;
+                } else if(ch == ';' || ch == ' ' || ch == '\t') {
+                    state = C_EXTENSION;
+                } else if(ch == '\r') {
+                    state = C_SIZE_LF;
+                } else if(ch == '\n') {
+                    state = decoder->remaining > 0 ? C_DATA : C_TRAILER_START;
+                } else {
+                    return -1;
+                }
+                break;
+
+            case C_EXTENSION:
+                if(ch == '\r')
+                    state = C_SIZE_LF;
+                else if(ch == '\n')
+                    state = decoder->remaining > 0 ? C_DATA : C_TRAILER_START;
+                break;
+
+            case C_SIZE_LF:
+                if(ch != '\n')
+                    return -1;
+                state = decoder->remaining > 0 ? C_DATA : C_TRAILER_START;
+                break;
+
+            case C_DATA_CR:
+                if(ch == '\r')
+                    state = C_DATA_LF;
+                else if(ch == '\n')
+                    state = C_SIZE;
+                else
+                    return -1;
+                decoder->digits = 0;
+                break;
+
+            case C_DATA_LF:
+                if(ch != '\n')
+                    return -1;
+                state = C_SIZE;
+                break;
+
+            case C_TRAILER_START: // the body ends with an empty line
+                if(ch == '\r')
+                    state = C_END_LF;
+                else if(ch == '\n')
+                    state = C_DONE;
+                else
+                    state = C_TRAILER;
+                break;
+
+            case C_TRAILER:
+                if(ch == '\r')
+                    state = C_TRAILER_LF;
+                else if(ch == '\n')
+                    state = C_TRAILER_START;
+                break;
+
+            case C_TRAILER_LF:
+                if(ch != '\n')
+                    return -1;
+                state = C_TRAILER_START;
+                break;
+
+            case C_END_LF:
+                if(ch != '\n')
+                    return -1;
+                state = C_DONE;
+                break;
+        }
+    }
+
+    decoder->state = state;
+    return pos;
+}
+
+/*
+ * Whether the last chunk and the trailers have been seen
+ */
+int chunked_done(const struct chunked_decoder *decoder)
+{
+    return decoder->state == C_DONE;
+}
@@ -0,0 +1,19 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+/*
+ * Resumable decoder for request bodies sent with Transfer-Encoding:
+ * chunked. It is fed whatever part of the body has arrived and points out
+ * the body bytes in it, so nothing has to be copied or buffered.
+ */
+struct chunked_decoder {
+    int state;
+    long long remaining; // bytes left in the current chunk
+    int digits;          // of the chunk size read so far
+};
+
+void chunked_init(struct chunked_decoder *decoder);
+int chunked_decode(struct chunked_decoder *decoder, const char *in, int len, int *data_start, int *data_len);
+int chunked_done(const struct chunked_decoder *decoder);
+
+#endif
@@ -0,0 +1,169 @@
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "stats.h"
+
+extern int idle_timeout;
+extern int header_timeout;
+extern int body_timeout;
+extern int send_timeout;
+
+#define MAX_CONN_TABLE (1 << 20)
+
+static struct conn **conn_table;
+static int conn_table_size;
+
+/*
+ * Allocates the table of connection slots. It is sized by the open file
+ * limit of the process, since no fd can ever be larger than that.
+ */
+void conn_table_init()
+{
+    struct rlimit rl;
+    conn_table_size = MAX_CONN_TABLE;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAX_CONN_TABLE)
+        conn_table_size = (int)rl.rlim_cur;
+
+    conn_table = (struct conn **)calloc(conn_table_size, sizeof(struct conn *));
+    if(conn_table == NULL)
+        err(1, "conn_table_init");
+}
+
+/*
+ * Returns the number of connection slots, every fd below it can be looked up
+ */
+int conn_table_limit()
+{
+    return conn_table_size;
+}
+
+/*
+ * Returns an empty connection slot for a freshly accepted fd. Slots are
+ * allocated on first use and then recycled along with the fd number.
+ */
+struct conn *conn_open(int fd)
+{
+    if(fd < 0 || fd >= conn_table_size)
+        return NULL;
+
+    struct conn *c = conn_table[fd];
+    if(c == NULL) {
+        c = (struct conn *)malloc(sizeof(struct conn));
+        if(c == NULL)
+            return NULL;
+        conn_table[fd] = c;
+    }
+
+    // a response leaves in one write, or with MSG_MORE in front of the
+    // sendfile() of its body, so Nagle's algorithm has nothing to merge and
+    // would only hold the end of a response back until the client's
+    // delayed ACK
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->fd = fd;
+    c->state = CONN_BUSY;
+    c->requests = 0;
+    c->keep_alive = 1;
+    timer_entry_init(&c->deadline, fd);
+    conn_reset(c);
+    return c;
+}
+
+/*
+ * Returns the connection slot of an fd that was opened with conn_open()
+ */
+struct conn *conn_lookup(int fd)
+{
+    if(fd < 0 || fd >= conn_table_size)
+        return NULL;
+    return conn_table[fd];
+}
+
+/*
+ * Closes the client socket and frees up its slot
+ */
+void conn_close(struct conn *c)
+{
+    timer_cancel(&c->deadline);
+    __atomic_store_n(&c->state, CONN_CLOSED, __ATOMIC_RELEASE);
+    conn_reset(c);
+    close(c->fd);
+}
+
+/*
+ * Throws away any buffered request bytes
+ */
+void conn_reset(struct conn *c)
+{
+    c->len = 0;
+    c->start = 0;
+    parser_init(&c->parser);
+}
+
+/*
+ * Drops the bytes of the request that was just answered. Anything after
+ * them belongs to a pipelined request and is moved to the front, where the
+ * parser starts over on it.
+ */
+void conn_consume(struct conn *c)
+{
+    c->len -= c->start;
+    memmove(c->buf, c->buf + c->start, c->len);
+    c->start = 0;
+    parser_init(&c->parser);
+}
+
+/*
+ * Starts the timeout of kind from now, replacing the one that ran before.
+ * The connection is shut down if the client has not done what it is
+ * waited for by then.
+ */
+void conn_deadline(struct conn *c, int kind)
+{
+    static const int *seconds[DEADLINES] = { &idle_timeout, &header_timeout, &body_timeout, &send_timeout };
+    timer_arm(&c->deadline, kind, *seconds[kind]);
+}
+
+/*
+ * Runs the parser over the bytes that arrived since the last call. Returns
+ * PARSE_DONE once the request head at the front of the buffer is complete.
+ */
+int conn_parse(struct conn *c)
+{
+    return parser_execute(&c->parser, c->buf, c->len);
+}
+
+/*
+ * Reads request body bytes. Bytes that were already buffered along with
+ * the headers are handed out first, the socket is only read after that.
+ * Returns 0 with errno set to ECONNRESET once the client has closed the
+ * connection, or once a deadline shut the socket down.
+ */
+ssize_t conn_read(struct conn *c, char *buf, size_t count)
+{
+    size_t buffered = c->len - c->start;
+    if(buffered == 0) {
+        conn_deadline(c, DEADLINE_BODY);
+        ssize_t bytes_read = read(c->fd, buf, count);
+        if(bytes_read > 0)
+            stats_add(STAT_BYTES_IN, bytes_read);
+        else if(bytes_read == 0)
+            errno = ECONNRESET;
+        return bytes_read;
+    }
+
+    if(count > buffered)
+        count = buffered;
+    memcpy(buf, c->buf + c->start, count);
+    c->start += count;
+    return count;
+}
@@ -0,0 +1,39 @@
+#include <sys/types.h>
+
+#include "parser.h"
+#include "timer.h"
+
+#define BUF_SIZE 8000
+
+// who currently owns a connection
+#define CONN_CLOSED 0
+#define CONN_IDLE 1 // waiting in the event loop for the next request
+#define CONN_BUSY 2 // being served by a worker thread
+
+/*
+ * State kept for every open client connection. Connections are indexed by
+ * their file descriptor, so the work queue can keep passing plain ints
+ * around and a worker looks the rest up with conn_lookup().
+ */
+struct conn {
+    int fd;
+    int state;              // CONN_CLOSED, CONN_IDLE or CONN_BUSY
+    int len;                // amount of bytes currently held in buf
+    int start;              // offset of the first byte not consumed yet
+    int requests;           // requests answered on this connection so far
+    int keep_alive;         // whether the connection outlives the current request
+    struct timer deadline;  // when to give up on the client, see timer.cpp
+    struct http_parser parser; // state of the request at the front of buf
+    char buf[BUF_SIZE];     // request bytes read so far
+};
+
+void conn_table_init();
+int conn_table_limit();
+struct conn *conn_open(int fd);
+struct conn *conn_lookup(int fd);
+void conn_close(struct conn *c);
+void conn_reset(struct conn *c);
+void conn_consume(struct conn *c);
+void conn_deadline(struct conn *c, int kind);
+int conn_parse(struct conn *c);
+ssize_t conn_read(struct conn *c, char *buf, size_t count);
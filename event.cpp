@@ -0,0 +1,206 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "event.h"
+#include "methods.h"
+#include "queue.h"
+#include "stats.h"
+
+#define MAX_EVENTS 256
+
+extern volatile sig_atomic_t listening;
+
+int epoll_fd = -1;
+
+/*
+ * Switch O_NONBLOCK on or off for a file descriptor
+ */
+static int set_nonblocking(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0)
+        return -1;
+
+    if(on)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Ask epoll to report the next time a client fd becomes readable. Client
+ * fds are registered one-shot so that only one thread owns a connection
+ * at any time.
+ */
+static void watch_conn(struct conn *c, int op)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = c->fd;
+    if(epoll_ctl(epoll_fd, op, c->fd, &ev) < 0) {
+        warn("epoll_ctl");
+        conn_close(c); // also takes its deadline off the wheel
+    }
+}
+
+/*
+ * Accept every connection that is waiting on the listening socket
+ */
+static void accept_conns(int listen_fd)
+{
+    for(;;) {
+        int new_conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if(new_conn < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                warn("accept");
+            return;
+        }
+
+        struct conn *c = conn_open(new_conn);
+        if(c == NULL) {
+            warnx("no connection slot for fd %d", new_conn);
+            close(new_conn);
+            continue;
+        }
+
+        conn_deadline(c, DEADLINE_IDLE);
+        c->state = CONN_IDLE;
+        watch_conn(c, EPOLL_CTL_ADD);
+    }
+}
+
+/*
+ * Drain whatever the client has sent so far. Once the headers are
+ * complete the socket is made blocking again and handed to the workers,
+ * otherwise it goes back to epoll until more data arrives.
+ */
+static void read_headers(struct conn *c, struct queue *queue)
+{
+    for(;;) {
+        int bytes_read = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+        if(bytes_read > 0) {
+            c->len += bytes_read;
+            stats_add(STAT_BYTES_IN, bytes_read);
+
+            int status = conn_parse(c);
+            if(status == PARSE_DONE) {
+                timer_cancel(&c->deadline);
+                set_nonblocking(c->fd, 0);
+                __atomic_store_n(&c->state, CONN_BUSY, __ATOMIC_RELEASE);
+                stats_queued(c->fd);
+                enqueue(queue, c->fd);
+                return;
+            }
+
+            if(status == PARSE_ERROR || c->len == BUF_SIZE) {
+                c->keep_alive = 0;
+                if(status == PARSE_ERROR)
+                    bad_request(c, "Malformed request");
+                else // headers will never fit in the buffer
+                    bad_request(c, "Request header too large");
+                conn_close(c);
+                return;
+            }
+
+            // a head that has begun has to be finished in time, however
+            // slowly its bytes trickle in
+            if(c->deadline.kind != DEADLINE_HEADER)
+                conn_deadline(c, DEADLINE_HEADER);
+            continue;
+        }
+
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+
+        if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            watch_conn(c, EPOLL_CTL_MOD);
+            return;
+        }
+
+        if(bytes_read < 0)
+            warn("Could not read from socket");
+
+        // the client hung up before finishing its request
+        conn_close(c);
+        return;
+    }
+}
+
+/*
+ * Called by a worker when a kept-alive connection has no complete request
+ * left in its buffer. The connection goes back to epoll, and the worker
+ * must not touch it afterwards.
+ */
+void event_rearm(struct conn *c)
+{
+    set_nonblocking(c->fd, 1);
+    conn_deadline(c, c->len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE);
+    __atomic_store_n(&c->state, CONN_IDLE, __ATOMIC_RELEASE);
+    watch_conn(c, EPOLL_CTL_MOD);
+}
+
+/*
+ * The server loop used in event mode. A single thread waits on every
+ * connection with epoll and only passes a connection on to the worker
+ * threads once a whole request header can be read from it, so idle or
+ * slow clients never hold a worker.
+ */
+void event_loop(int listen_fd, struct queue *queue)
+{
+    epoll_fd = epoll_create1(0);
+    if(epoll_fd < 0)
+        err(1, "epoll_create1");
+
+    if(set_nonblocking(listen_fd, 1) < 0)
+        err(1, "fcntl");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        err(1, "epoll_ctl");
+
+    // the signals that end the server are only let through while waiting,
+    // so one that arrives between checking listening and going to sleep
+    // still wakes epoll_pwait() up instead of being missed
+    sigset_t quit, waiting;
+    sigemptyset(&quit);
+    sigaddset(&quit, SIGINT);
+    sigaddset(&quit, SIGQUIT);
+    sigaddset(&quit, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quit, &waiting);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(listening) {
+        int ready = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &waiting);
+        if(ready < 0) {
+            if(errno != EINTR) // if errno == EINTR then the server is quitting
+                warn("epoll_wait");
+            continue;
+        }
+
+        for(int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if(fd == listen_fd) {
+                accept_conns(listen_fd);
+                continue;
+            }
+
+            struct conn *c = conn_lookup(fd);
+            if(c != NULL && c->state == CONN_IDLE)
+                read_headers(c, queue);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &waiting, NULL);
+    close(epoll_fd);
+}
@@ -0,0 +1,5 @@
+struct conn;
+struct queue;
+
+void event_loop(int listen_fd, struct queue *queue);
+void event_rearm(struct conn *c);
@@ -0,0 +1,274 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "stats.h"
+#include "store.h"
+
+#define NAME_LEN 27
+
+/*
+ * A cached read-only fd together with the stat info taken when it was
+ * opened. The cache holds one reference while the entry is in the table,
+ * and every GET using it holds another, so the fd is only closed once an
+ * evicted or invalidated entry is no longer being sent.
+ */
+struct fd_entry {
+    char name[NAME_LEN + 1];
+    int fd;
+    off_t offset;
+    struct stat st;
+    int refs;
+    struct fd_entry *prev; // LRU list, most recently used first
+    struct fd_entry *next;
+    struct fd_entry *hash_next;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_entry **buckets;
+static unsigned bucket_mask;
+static struct fd_entry *lru_head;
+static struct fd_entry *lru_tail;
+static int entries;
+static int max_entries; // 0 when the cache is off
+
+// one per bucket, bumped whenever an entry of the bucket is invalidated,
+// so a file opened before that is not put into the cache afterwards while
+// misses on the other buckets go on filling it
+static unsigned *generations;
+
+/*
+ * FNV-1a hash of a resource name
+ */
+static unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for(; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+/*
+ * Find an entry in the table, the cache mutex must be held
+ */
+static struct fd_entry *lookup(const char *name)
+{
+    struct fd_entry *entry = buckets[hash_name(name) & bucket_mask];
+    while(entry != NULL && strcmp(entry->name, name) != 0)
+        entry = entry->hash_next;
+    return entry;
+}
+
+static void lru_unlink(struct fd_entry *entry)
+{
+    if(entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if(entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+}
+
+static void lru_push_front(struct fd_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if(lru_head)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if(lru_tail == NULL)
+        lru_tail = entry;
+}
+
+/*
+ * Drop a reference, and close the fd along with the last one. Returns the
+ * entry to free, since the fd should not be closed under the mutex.
+ */
+static struct fd_entry *unref(struct fd_entry *entry)
+{
+    return --entry->refs == 0 ? entry : NULL;
+}
+
+static void destroy(struct fd_entry *entry)
+{
+    if(entry != NULL) {
+        close(entry->fd);
+        free(entry);
+    }
+}
+
+/*
+ * Take an entry out of the table and drop the cache's reference to it, the
+ * cache mutex must be held. Returns the entry if it has to be destroyed.
+ */
+static struct fd_entry *remove_entry(struct fd_entry *entry)
+{
+    struct fd_entry **link = &buckets[hash_name(entry->name) & bucket_mask];
+    while(*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    lru_unlink(entry);
+    entries--;
+    return unref(entry);
+}
+
+/*
+ * Sets up a cache of up to capacity open files. With a capacity of 0 every
+ * request opens the file itself.
+ */
+void fdcache_init(int capacity)
+{
+    max_entries = capacity;
+    if(capacity <= 0)
+        return;
+
+    unsigned size = 1;
+    while(size < (unsigned)capacity * 2)
+        size <<= 1;
+    buckets = (struct fd_entry **)calloc(size, sizeof(struct fd_entry *));
+    generations = (unsigned *)calloc(size, sizeof(unsigned));
+    if(buckets == NULL || generations == NULL)
+        err(1, "fdcache_init");
+    bucket_mask = size - 1;
+}
+
+/*
+ * Opens a resource for reading and fills in file. Returns 0 on success or
+ * an errno value, so the caller can tell a missing file (ENOENT) from one
+ * it may not read (EACCES).
+ */
+int fdcache_open(const char *name, struct cached_file *file)
+{
+    unsigned bucket = 0, opened_generation = 0;
+    if(max_entries > 0) {
+        bucket = hash_name(name) & bucket_mask;
+        pthread_mutex_lock(&cache_mutex);
+        struct fd_entry *entry = lookup(name);
+        if(entry != NULL) {
+            entry->refs++;
+            lru_unlink(entry);
+            lru_push_front(entry);
+            pthread_mutex_unlock(&cache_mutex);
+
+            file->fd = entry->fd;
+            file->offset = entry->offset;
+            file->st = entry->st;
+            file->entry = entry;
+            stats_add(STAT_FDCACHE_HITS, 1);
+            return 0;
+        }
+        opened_generation = generations[bucket];
+        pthread_mutex_unlock(&cache_mutex);
+        stats_add(STAT_FDCACHE_MISSES, 1);
+    }
+
+    // not cached, open the file without holding the mutex
+    int fd = store_open(name, &file->st, &file->offset);
+    if(fd < 0)
+        return errno;
+    file->fd = fd;
+    file->entry = NULL;
+
+    if(max_entries <= 0 || strlen(name) != NAME_LEN)
+        return 0;
+
+    struct fd_entry *entry = (struct fd_entry *)malloc(sizeof(struct fd_entry));
+    if(entry == NULL)
+        return 0;
+    strcpy(entry->name, name);
+    entry->fd = fd;
+    entry->offset = file->offset;
+    entry->st = file->st;
+    entry->refs = 2; // the cache and this request
+
+    struct fd_entry *evicted = NULL;
+    pthread_mutex_lock(&cache_mutex);
+    if(generations[bucket] != opened_generation || lookup(name) != NULL) {
+        // a PUT may have replaced the file since it was opened, or somebody
+        // else opened it in the meantime, so keep the fd to this request
+        pthread_mutex_unlock(&cache_mutex);
+        free(entry);
+        return 0;
+    }
+
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(entry);
+    if(++entries > max_entries)
+        evicted = remove_entry(lru_tail);
+    pthread_mutex_unlock(&cache_mutex);
+
+    destroy(evicted);
+    file->entry = entry;
+    return 0;
+}
+
+/*
+ * Gives back a file from fdcache_open()
+ */
+void fdcache_close(struct cached_file *file)
+{
+    if(file->entry == NULL) {
+        close(file->fd);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    struct fd_entry *dead = unref(file->entry);
+    pthread_mutex_unlock(&cache_mutex);
+    destroy(dead);
+}
+
+/*
+ * Forget the cached fd of a resource that has been changed. Requests that
+ * are still sending the old file keep it open until they are done.
+ */
+void fdcache_invalidate(const char *name)
+{
+    if(max_entries <= 0)
+        return;
+
+    pthread_mutex_lock(&cache_mutex);
+    generations[hash_name(name) & bucket_mask]++;
+    struct fd_entry *entry = lookup(name);
+    struct fd_entry *dead = entry ? remove_entry(entry) : NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    destroy(dead);
+}
+
+/*
+ * Forget every cached fd, used when changes to the files may have been
+ * missed
+ */
+void fdcache_clear()
+{
+    if(max_entries <= 0)
+        return;
+
+    pthread_mutex_lock(&cache_mutex);
+    for(unsigned bucket = 0; bucket <= bucket_mask; bucket++)
+        generations[bucket]++;
+    struct fd_entry *dead = NULL;
+    while(lru_head != NULL) {
+        struct fd_entry *entry = remove_entry(lru_head);
+        if(entry) {
+            entry->hash_next = dead;
+            dead = entry;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    while(dead != NULL) {
+        struct fd_entry *next = dead->hash_next;
+        destroy(dead);
+        dead = next;
+    }
+}
@@ -0,0 +1,21 @@
+#include <sys/stat.h>
+
+struct fd_entry;
+
+/*
+ * An open resource handed out by fdcache_open(). When the cache is
+ * enabled the fd is shared with other requests, so it must only be read
+ * at explicit offsets and never closed directly.
+ */
+struct cached_file {
+    int fd;
+    off_t offset; // where the resource starts in fd
+    struct stat st;
+    struct fd_entry *entry; // NULL if the fd belongs to the caller alone
+};
+
+void fdcache_init(int capacity);
+int fdcache_open(const char *name, struct cached_file *file);
+void fdcache_close(struct cached_file *file);
+void fdcache_invalidate(const char *name);
+void fdcache_clear();
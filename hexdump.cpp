@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEXDUMP_X86 1
+#endif
+
+#include "hexdump.h"
+
+/*
+ * The log has always formatted the body as a plain char array with %02x, so
+ * bytes from 0x80 up are sign extended and show up as "ff". Every encoder
+ * has to keep doing that to stay byte for byte compatible.
+ */
+
+typedef void (*line_encoder)(char *out, const unsigned char *in);
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static char hex_pairs[256][2];
+
+/*
+ * Writes the "%08d " index that starts every line
+ */
+static char *format_index(char *out, int index)
+{
+    if(index < 0 || index >= 100000000)
+        return out + sprintf(out, "%08d ", index);
+
+    for(int i = 7; i >= 0; i--) {
+        out[i] = '0' + index % 10;
+        index /= 10;
+    }
+    out[8] = ' ';
+    return out + 9;
+}
+
+/*
+ * Writes the hex pairs of a line of len bytes followed by a newline
+ */
+static char *format_bytes(char *out, const unsigned char *in, int len)
+{
+    for(int i = 0; i < len; i++) {
+        out[0] = hex_pairs[in[i]][0];
+        out[1] = hex_pairs[in[i]][1];
+        out[2] = ' ';
+        out += 3;
+    }
+    out[-1] = '\n';
+    return out;
+}
+
+/*
+ * Each encoder formats a full line of 20 bytes into its 60 characters,
+ * the last of which is the newline
+ */
+static void line_scalar(char *out, const unsigned char *in)
+{
+    format_bytes(out, in, HEXDUMP_LINE_BYTES);
+}
+
+#ifdef HEXDUMP_X86
+/*
+ * SSE2 turns the nibbles into digits with a compare and add, and
+ * interleaves them into pairs, which are then spread out to make room for
+ * the spaces
+ */
+__attribute__((target("sse2"))) static __m128i hex_sse2(__m128i nibbles)
+{
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+__attribute__((target("sse2"))) static void line_sse2(char *out, const unsigned char *in)
+{
+    int tail;
+    memcpy(&tail, in + 16, 4);
+    __m128i bytes[2] = { _mm_loadu_si128((const __m128i *)in), _mm_cvtsi32_si128(tail) };
+
+    char pairs[48] __attribute__((aligned(16)));
+    for(int i = 0; i < 2; i++) {
+        __m128i v = _mm_or_si128(bytes[i], _mm_cmplt_epi8(bytes[i], _mm_setzero_si128()));
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i hi = hex_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = hex_sse2(_mm_and_si128(v, mask));
+        _mm_store_si128((__m128i *)(pairs + 32 * i), _mm_unpacklo_epi8(hi, lo));
+        if(i == 0)
+            _mm_store_si128((__m128i *)(pairs + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    for(int i = 0; i < HEXDUMP_LINE_BYTES; i++) {
+        memcpy(out + 3 * i, pairs + 2 * i, 2);
+        out[3 * i + 2] = ' ';
+    }
+    out[3 * HEXDUMP_LINE_BYTES - 1] = '\n';
+}
+
+/*
+ * AVX2 looks the digits up with a shuffle and then shuffles them straight
+ * into place, two 16 byte blocks of output at a time. Output byte j of the
+ * line is the high digit, the low digit or the space after byte j / 3.
+ */
+static char avx2_hi[4][16] __attribute__((aligned(32)));
+static char avx2_lo[4][16] __attribute__((aligned(32)));
+static char avx2_sp[4][16] __attribute__((aligned(32)));
+
+static void init_avx2_tables()
+{
+    for(int j = 0; j < 64; j++) {
+        int block = j / 16, byte = j / 3 - (block == 3 ? 16 : 0);
+        int valid = j < 3 * HEXDUMP_LINE_BYTES;
+        avx2_hi[block][j % 16] = valid && j % 3 == 0 ? byte : (char)0x80;
+        avx2_lo[block][j % 16] = valid && j % 3 == 1 ? byte : (char)0x80;
+        avx2_sp[block][j % 16] = valid && j % 3 == 2 ? ' ' : 0;
+    }
+}
+
+__attribute__((target("avx2"))) static void line_avx2(char *out, const unsigned char *in)
+{
+    int tail;
+    memcpy(&tail, in + 16, 4);
+    __m256i v = _mm256_set_m128i(_mm_cvtsi32_si128(tail), _mm_loadu_si128((const __m128i *)in));
+    v = _mm256_or_si256(v, _mm256_cmpgt_epi8(_mm256_setzero_si256(), v));
+
+    __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, mask));
+
+    // blocks 0 and 1 come from the first 16 bytes, blocks 2 and 3 from the
+    // first 16 and the last 4, which is how the lanes already are
+    for(int half = 0; half < 2; half++) {
+        __m256i src_hi = half ? hi : _mm256_permute2x128_si256(hi, hi, 0x00);
+        __m256i src_lo = half ? lo : _mm256_permute2x128_si256(lo, lo, 0x00);
+        __m256i text = _mm256_or_si256(
+          _mm256_or_si256(_mm256_shuffle_epi8(src_hi, _mm256_load_si256((const __m256i *)avx2_hi[2 * half])),
+            _mm256_shuffle_epi8(src_lo, _mm256_load_si256((const __m256i *)avx2_lo[2 * half]))),
+          _mm256_load_si256((const __m256i *)avx2_sp[2 * half]));
+        _mm256_storeu_si256((__m256i *)(out + 32 * half), text);
+    }
+    out[3 * HEXDUMP_LINE_BYTES - 1] = '\n';
+}
+#endif
+
+/*
+ * Works out what the cpu can do and sets up the tables, before main() so
+ * that the worker threads never race on it
+ */
+static int best_encoder()
+{
+    for(int i = 0; i < 256; i++) {
+        int value = i >= 0x80 ? 0xff : i;
+        hex_pairs[i][0] = hex_digits[value >> 4];
+        hex_pairs[i][1] = hex_digits[value & 0xf];
+    }
+
+#ifdef HEXDUMP_X86
+    init_avx2_tables();
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return HEXDUMP_AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return HEXDUMP_SSE2;
+#endif
+    return HEXDUMP_SCALAR;
+}
+
+static int encoder = best_encoder();
+static int best = encoder;
+
+/*
+ * Formats len bytes of a body, the first of which is byte index of the
+ * body, into out. out needs room for HEXDUMP_LINE_MAX bytes per started
+ * line plus HEXDUMP_SLACK. Returns the length of the text.
+ */
+int hexdump_format(char *out, const char *content, int len, int index)
+{
+    static const line_encoder encoders[] = {
+        line_scalar,
+#ifdef HEXDUMP_X86
+        line_sse2,
+        line_avx2,
+#endif
+    };
+    line_encoder line = encoders[encoder];
+
+    const unsigned char *in = (const unsigned char *)content;
+    char *start = out;
+    for(; len >= HEXDUMP_LINE_BYTES; len -= HEXDUMP_LINE_BYTES) {
+        out = format_index(out, index);
+        line(out, in);
+        out += 3 * HEXDUMP_LINE_BYTES;
+        in += HEXDUMP_LINE_BYTES;
+        index += HEXDUMP_LINE_BYTES;
+    }
+
+    if(len > 0) {
+        out = format_index(out, index);
+        out = format_bytes(out, in, len);
+    }
+
+    return out - start;
+}
+
+/*
+ * Switches to another encoder, which the benchmark uses to compare them.
+ * Returns -1 if the cpu does not support it.
+ */
+int hexdump_use(int choice)
+{
+    if(choice < HEXDUMP_SCALAR || choice > best)
+        return -1;
+    encoder = choice;
+    return 0;
+}
+
+/*
+ * Name of the encoder in use
+ */
+const char *hexdump_encoder()
+{
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    return names[encoder];
+}
@@ -0,0 +1,14 @@
+/*
+ * Formatting of PUT bodies for the log: lines of "%08d " followed by up to
+ * 20 bytes as space separated hex pairs.
+ */
+
+#define HEXDUMP_LINE_BYTES 20
+#define HEXDUMP_LINE_MAX 72 // longest line, with an index of up to ten digits
+#define HEXDUMP_SLACK 8     // room past the end the vector encoders may scribble on
+
+enum { HEXDUMP_SCALAR, HEXDUMP_SSE2, HEXDUMP_AVX2 };
+
+int hexdump_format(char *out, const char *content, int len, int index);
+int hexdump_use(int encoder);
+const char *hexdump_encoder();
@@ -0,0 +1,72 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binlog.h"
+#include "hexdump.h"
+
+/*
+ * Turns a binary log written by httpserver -b back into the text log
+ * format, on standard output.
+ *
+ * Usage: httplog-render [binary log]
+ */
+
+#define CHUNK 8000 // body bytes formatted at a time, a whole number of lines
+
+static char body[CHUNK];
+static char text[CHUNK / HEXDUMP_LINE_BYTES * HEXDUMP_LINE_MAX + HEXDUMP_SLACK];
+
+/*
+ * Writes the hex lines of a PUT body the way write_hex_to_log() does
+ */
+static void render_body(FILE *in, long long length, long long record_offset)
+{
+    for(long long done = 0; done < length;) {
+        size_t len = length - done < CHUNK ? length - done : CHUNK;
+        if(fread(body, 1, len, in) != len)
+            errx(1, "body of the record at offset %lld is cut short", record_offset);
+
+        int text_len = hexdump_format(text, body, len, done);
+        fwrite(text, 1, text_len, stdout);
+        done += len;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = stdin;
+    if(argc > 2) {
+        fprintf(stderr, "Usage: %s [binary log]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if(argc == 2 && (in = fopen(argv[1], "rb")) == NULL)
+        err(1, "%s", argv[1]);
+
+    struct binlog_record record;
+    char resource[UINT16_MAX + 1];
+    long long offset = 0;
+    while(fread(&record, sizeof(record), 1, in) == 1) {
+        if(record.magic != BINLOG_MAGIC)
+            errx(1, "no log record at offset %lld", offset);
+        if(fread(resource, 1, record.resource_len, in) != record.resource_len)
+            errx(1, "record at offset %lld is cut short", offset);
+        resource[record.resource_len] = '\0';
+        record.method[sizeof(record.method) - 1] = '\0';
+
+        if(record.status != 0) {
+            printf("FAIL: %s %s HTTP/1.1 --- response %d\n", record.method, resource, record.status);
+        } else {
+            printf("%s %s length %lld\n", record.method, resource, (long long)record.length);
+            render_body(in, record.length, offset);
+        }
+        printf("========\n");
+
+        offset += sizeof(record) + record.resource_len + record.length;
+    }
+
+    if(ferror(in))
+        err(1, "read");
+    return 0;
+}
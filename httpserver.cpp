@@ -10,15 +10,35 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "conn.h"
+#include "event.h"
+#include "fdcache.h"
 #include "methods.h"
+#include "objcache.h"
+#include "pack.h"
+#include "pool.h"
 #include "queue.h"
+#include "reslock.h"
+#include "stats.h"
+#include "store.h"
+#include "timer.h"
+#include "uring.h"
+#include "watch.h"
 #include "worker.h"
 
 int log_offset;
 int log_fd;
+int log_binary;   // write the log as binary records instead of text
+int event_mode;   // multiplex connections with epoll instead of blocking accept
+int max_requests; // requests answered on one connection before it is closed
+int idle_timeout; // seconds a kept-alive connection may wait for a request
+int header_timeout; // seconds a client has to finish a request head it began
+int body_timeout;   // seconds a request body may stall
+int send_timeout;   // seconds a client may stall taking a response
+int uring_mode;   // workers do their I/O through io_uring
+long long direct_threshold; // PUT bodies this big bypass the page cache, 0 never does
+int stats_endpoint;         // answer GET /__stats
 
-pthread_cond_t condl;
-pthread_mutex_t mutex;
 pthread_mutex_t log_mutex; // mutex for log offset
 
 volatile sig_atomic_t listening = 1; // sentinel value to run server
@@ -41,6 +61,49 @@ static void sig_handler(int signal)
     }
 }
 
+/*
+ * Creates a socket bound to the address in servinfo and starts listening
+ * on it. With reuseport set, one socket can be opened per worker on the
+ * same address and the kernel spreads new connections over them.
+ */
+static int open_listener(struct addrinfo *servinfo, int reuseport)
+{
+    // set up the socket
+    int fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if(fd == -1) {
+        err(1, NULL);
+    }
+
+    // allow the server to recapture the socket (prevents already bound error)
+    int yes = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0)
+        err(1, "setsockopt(SO_REUSEADDR) error");
+
+    if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0)
+        err(1, "setsockopt(SO_REUSEPORT) error");
+
+    if(bind(fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+        err(1, "failed to bind");
+    }
+
+    if(listen(fd, SOMAXCONN) == -1) {
+        err(1, "failed to listen");
+    }
+
+    return fd;
+}
+
+/*
+ * Prints how to start the server and exits
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr,
+      "Usage: %s [-W workers] [-Q queue size] [-l logfile] [-b] [-e] [-r] [-p] [-K requests] [-T seconds] [-H seconds] [-B seconds] [-O seconds] [-F entries] [-C megabytes] [-U] [-D megabytes] [-S flat|dedup|packed] [-M] [-X max workers] [-G milliseconds] [-I seconds] host [port]\n",
+      program);
+    exit(EXIT_FAILURE);
+}
+
 /*
  * The entry of the point of the application, which also contains the main
  * server loop.
@@ -48,19 +111,42 @@ static void sig_handler(int signal)
 int main(int argc, char *argv[])
 {
     int opt;
-    int workers = 4; // default amount of worker threads is four
+    int workers = 4;           // default amount of worker threads is four
+    int max_workers = 0;       // the pool may grow up to this, 0 keeps it at workers
+    int grow_wait_ms = 1;      // queue wait that makes the pool grow
+    int shrink_idle = 5;       // seconds workers are spare before the pool shrinks
+    int queue_capacity = 1024; // connections waiting for a worker
+    int reuseport = 0;         // every worker accepts on its own listener
+    int pin_workers = 0;       // bind each worker thread to one cpu
+    int fd_cache_size = 0;     // open files kept for GET, 0 disables the cache
+    int obj_cache_mb = 0;      // memory for small files kept for GET, 0 disables it
+    int storage = STORE_FLAT;  // how resources are kept on disk
 
     log_offset = 0;
     log_fd = -1;
-
-    while((opt = getopt(argc, argv, "W:l:")) != -1) {
+    log_binary = 0;
+    event_mode = 0;
+    max_requests = 100;
+    idle_timeout = 5;
+    header_timeout = 10;
+    body_timeout = 5;
+    send_timeout = 10;
+    uring_mode = 0;
+    direct_threshold = 0;
+    stats_endpoint = 0;
+
+    while((opt = getopt(argc, argv, "W:Q:l:berpK:T:H:B:O:F:C:UD:S:MX:G:I:")) != -1) {
         switch(opt) {
             case 'W': // flag for setting workers
                 workers = atoi(optarg);
                 break;
+            case 'Q': // flag for the size of the connection queue
+                queue_capacity = atoi(optarg);
+                break;
             case 'l': // flag for setting logfile
                 if(!strcmp(optarg, "httpserver.access.log")
-                   || !strcmp(optarg, "httpserver.error.log")) {
+                   || !strcmp(optarg, "httpserver.error.log")
+                   || !strcmp(optarg, "httpserver.stats.json")) {
                     fprintf(stderr,
                       "%s: %s is a reserved filename, please name the log differently\n",
                       argv[0],
@@ -72,9 +158,69 @@ int main(int argc, char *argv[])
                 if(log_fd < 0)
                     err(1, "%s", optarg);
                 break;
+            case 'b': // flag for the binary log format
+                log_binary = 1;
+                break;
+            case 'e': // flag for the epoll event loop
+                event_mode = 1;
+                break;
+            case 'r': // flag for per-worker SO_REUSEPORT listeners
+                reuseport = 1;
+                break;
+            case 'p': // flag for pinning workers to cpus
+                pin_workers = 1;
+                break;
+            case 'K': // flag for the requests allowed per connection
+                max_requests = atoi(optarg);
+                break;
+            case 'T': // flag for the keep-alive idle timeout
+                idle_timeout = atoi(optarg);
+                break;
+            case 'H': // flag for the request head deadline
+                header_timeout = atoi(optarg);
+                break;
+            case 'B': // flag for the request body deadline
+                body_timeout = atoi(optarg);
+                break;
+            case 'O': // flag for the response send deadline
+                send_timeout = atoi(optarg);
+                break;
+            case 'F': // flag for the size of the fd cache
+                fd_cache_size = atoi(optarg);
+                break;
+            case 'C': // flag for the size of the object cache
+                obj_cache_mb = atoi(optarg);
+                break;
+            case 'U': // flag for the io_uring backend
+                uring_mode = 1;
+                break;
+            case 'D': // flag for the size of PUTs written with O_DIRECT
+                direct_threshold = atoll(optarg) << 20;
+                break;
+            case 'X': // flag for the most workers the pool may grow to
+                max_workers = atoi(optarg);
+                break;
+            case 'G': // flag for the queue wait that grows the pool
+                grow_wait_ms = atoi(optarg);
+                break;
+            case 'I': // flag for the idle time that shrinks the pool
+                shrink_idle = atoi(optarg);
+                break;
+            case 'M': // flag for serving statistics over HTTP
+                stats_endpoint = 1;
+                break;
+            case 'S': // flag for the storage mode
+                if(!strcmp(optarg, "flat"))
+                    storage = STORE_FLAT;
+                else if(!strcmp(optarg, "dedup"))
+                    storage = STORE_DEDUP;
+                else if(!strcmp(optarg, "packed"))
+                    storage = STORE_PACKED;
+                else
+                    usage(argv[0]);
+                break;
             default: // '?'
-                fprintf(stderr, "Usage: %s [-W workers] host [port]\n", argv[0]);
-                exit(EXIT_FAILURE);
+                usage(argv[0]);
         }
     }
 
@@ -83,20 +229,101 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if(optind >= argc) { // if optind >= argc then no host was specified
-        fprintf(stderr, "Usage: %s [-W workers] host [port]\n", argv[0]);
+    if(max_workers == 0 || reuseport) // -r listeners are only made up front
+        max_workers = workers;
+    if(max_workers < workers || grow_wait_ms < 0 || shrink_idle < 0) {
+        fprintf(stderr, "%s: -X cannot be below -W, and -G and -I cannot be negative\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(event_mode && reuseport) {
+        fprintf(stderr, "%s: -e and -r cannot be used together\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(queue_capacity < 1) {
+        fprintf(stderr, "%s: the connection queue needs room for at least one connection\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    if(max_requests < 1 || idle_timeout < 0 || header_timeout < 0 || body_timeout < 0 || send_timeout < 0) {
+        fprintf(stderr, "%s: -K needs at least one request and -T, -H, -B and -O cannot be negative\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(obj_cache_mb < 0) {
+        fprintf(stderr, "%s: the object cache size cannot be negative\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(optind >= argc) { // if optind >= argc then no host was specified
+        usage(argv[0]);
+    }
+
     int i;
-    pthread_t *thread;
-    // allocate threads based on # of workers requested
-    thread = (pthread_t *)malloc(workers * sizeof(pthread_t));
+    struct worker *worker;
+    // allocate threads based on # of workers the pool may grow to
+    worker = (struct worker *)malloc(max_workers * sizeof(struct worker));
+
+    // SIGUSR1 is only ever taken by the statistics thread, so it is masked
+    // before any thread is started, the helpers of the caches included
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &usr1, NULL) < 0)
+        warn("pthread_sigmask");
+
+    // a client that went away, or was shut down by its deadline, must only
+    // fail the write to it, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    struct queue *queue = new_queue(queue_capacity);
+    conn_table_init();
+    stats_init(queue, conn_table_limit());
+    fdcache_init(fd_cache_size);
+    objcache_init((size_t)obj_cache_mb << 20);
+    reslock_init();
+    store_init(storage);
+    if(fd_cache_size > 0 || obj_cache_mb > 0)
+        watch_start();
+
+    // find out once whether the kernel can do io_uring, rather than have
+    // every worker complain
+    if(uring_mode) {
+        if(uring_init(log_fd) < 0) {
+            warn("io_uring not available, using plain system calls");
+            uring_mode = 0;
+        }
+        uring_exit();
+    }
+
+    int status;
+    struct addrinfo hints, *servinfo;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;       // ipv4
+    hints.ai_socktype = SOCK_STREAM; // tcp
+
+    const char *port = "80"; // default port is 80
+    if(optind + 1 < argc)    // user specified a port
+        port = argv[optind + 1];
+
+    if((status = getaddrinfo(argv[optind], port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    } // resolve interface from user input
 
-    pthread_cond_init(&condl, NULL);
-    pthread_mutex_init(&mutex, NULL);
+    // with -r every worker gets a listener of its own, otherwise the main
+    // thread accepts for everybody
+    int fd = -1;
+    for(i = 0; i < max_workers; i++) {
+        worker[i].queue = queue;
+        worker[i].listen_fd = reuseport ? open_listener(servinfo, 1) : -1;
+    }
+    if(!reuseport)
+        fd = open_listener(servinfo, 0);
 
-    struct queue *queue = new_queue();
+    freeaddrinfo(servinfo);
 
     // all of these signals are masked from the worker
     // threads because they are handled by the main thread
@@ -111,13 +338,24 @@ int main(int argc, char *argv[])
     if(pthread_sigmask(SIG_SETMASK, &set, NULL) < 0)
         warn("pthread_sigmask");
 
-    // initialize all threads
-    for(i = 0; i < workers; i++) {
-        pthread_create(&thread[i], NULL, accept_job, queue);
-    }
+    // deadlines of the connections are kept by a thread of its own
+    timer_start();
+
+    // start the workers, and let the pool grow and shrink between -W and -X
+    struct pool_tuning tuning;
+    tuning.min_workers = workers;
+    tuning.max_workers = max_workers;
+    tuning.grow_wait_us = grow_wait_ms * 1000LL;
+    tuning.idle_seconds = shrink_idle;
+    pool_start(worker, queue, &tuning, pin_workers);
+
+    // SIGUSR1 stays masked everywhere, a thread of its own waits for it
+    // and dumps the statistics
+    stats_start_dumper();
 
-    // unmask signals from the main thread
+    // unmask the other signals from the main thread
     sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
     if(pthread_sigmask(SIG_SETMASK, &set, NULL) < 0)
         warn("pthread_sigmask");
 
@@ -136,49 +374,18 @@ int main(int argc, char *argv[])
     sigaction(SIGTERM, &a, NULL);
 
     signal(SIGHUP, sig_handler);
-    signal(SIGUSR1, sig_handler);
     signal(SIGUSR2, sig_handler);
 
-    int status;
-    struct addrinfo hints, *servinfo;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;       // ipv4
-    hints.ai_socktype = SOCK_STREAM; // tcp
-
-    char *port = (char *)malloc(6); // highest possible port number is 65535
-    strncpy(port, "80", 6);         // default port is 80
-    if(optind + 1 < argc)           // user specified a port
-        port = argv[optind + 1];
-
-    if((status = getaddrinfo(argv[optind], port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-        exit(EXIT_FAILURE);
-    } // resolve interface from user input
-
-    // set up the socket
-    int fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if(fd == -1) {
-        err(1, NULL);
-    }
-
-    // allow the server to recapture the socket (prevents already bound error)
-    int yes = 1;
-    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0)
-        err(1, "setsockopt(SO_REUSEADDR) error");
-
-    if(bind(fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-        err(1, "failed to bind");
-    }
-
-    freeaddrinfo(servinfo);
-    free(port);
-
-    if(listen(fd, 10) == -1) {
-        err(1, "failed to listen");
+    int new_conn;
+    if(reuseport) {
+        // the workers accept by themselves, so only wait for signals
+        while(listening)
+            pause();
+    } else if(event_mode) {
+        // wait on all connections at once and only queue complete requests
+        event_loop(fd, queue);
     }
 
-    int new_conn;
     while(listening) {
         // accept new connection when it arrives
         new_conn = accept(fd, NULL, NULL);
@@ -187,6 +394,7 @@ int main(int argc, char *argv[])
                 warn("accept");
             continue;
         }
+        stats_queued(new_conn);
         enqueue(queue, new_conn); // add connection to the work queue
     }
 
@@ -194,21 +402,46 @@ int main(int argc, char *argv[])
     printf("Quitting...\n");
 
     // send -2 to all worker threads, which is their signal to
-    // terminate
-    for(i = 0; i < workers; i++) {
-        enqueue(queue, -2);
+    // terminate, and wait for them to finish working. Workers with their
+    // own listener are woken up by shutting it down instead.
+    pool_stop();
+    for(i = 0; reuseport && i < workers; i++)
+        close(worker[i].listen_fd);
+
+    if(fd >= 0)
+        close(fd);
+    close(log_fd);
+
+    free(worker);
+    free_queue(queue);
+
+    if(objcache_enabled()) {
+        unsigned long long hits, misses;
+        objcache_stats(&hits, &misses);
+        printf("object cache: %llu hits, %llu misses\n", hits, misses);
     }
 
-    // wait for the threads to finish working
-    for(i = 0; i < workers; i++) {
-        pthread_join(thread[i], NULL);
+    if(store_mode() == STORE_DEDUP) {
+        unsigned long long names, duplicates;
+        store_stats(&names, &duplicates);
+        printf("dedup store: %llu resources, %llu PUTs of bodies already stored\n", names, duplicates);
     }
 
-    close(fd);
-    close(log_fd);
+    if(store_mode() == STORE_PACKED) {
+        struct pack_usage usage;
+        pack_stats(&usage);
+        printf("packed store: %d segments, %llu bytes live, %llu bytes dead, %llu segments compacted\n",
+          usage.segments,
+          usage.live_bytes,
+          usage.dead_bytes,
+          usage.compactions);
+    }
 
-    free(thread);
-    free(queue);
+    if(timer_expired(DEADLINE_HEADER) + timer_expired(DEADLINE_BODY) + timer_expired(DEADLINE_SEND) > 0)
+        printf("evicted clients: %llu too slow with the request head, %llu with the body, %llu taking the response\n",
+          timer_expired(DEADLINE_HEADER),
+          timer_expired(DEADLINE_BODY),
+          timer_expired(DEADLINE_SEND));
 
     return 0;
 }
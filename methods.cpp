@@ -1,23 +1,47 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "binlog.h"
+#include "chunked.h"
+#include "conn.h"
+#include "fdcache.h"
+#include "hexdump.h"
 #include "methods.h"
+#include "objcache.h"
+#include "range.h"
+#include "reslock.h"
+#include "stats.h"
+#include "store.h"
+#include "uring.h"
 
 extern int log_fd;
+extern int log_binary;
 extern int log_offset;
 extern pthread_mutex_t log_mutex;
+extern long long direct_threshold;
 
-#define BUF_SIZE 8000
+// PUTs that bypass the page cache write in pieces of this size, aligned
+// for O_DIRECT
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (1 << 20)
+
+// most bytes handed to one blocking sendfile() before the send deadline is
+// pushed back
+#define SEND_CHUNK (1 << 20)
 
 /*
  * This function checks using regex to see if the filename supplied
@@ -47,190 +71,1159 @@ int valid_filename(char *filename)
     return 0;
 }
 
+/*
+ * The status line of every response the server sends, written out once so
+ * that a response starts with a pointer and a length instead of a format
+ * string
+ */
+struct status_line {
+    int code;
+    const char *line;
+    int len;
+};
+
+#define STATUS_LINE(code, reason) \
+    { code, "HTTP/1.1 " #code " " reason "\r\n", (int)sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+static const struct status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(500, "Internal Server Error"), // last, stands in for unknown codes
+};
+
+#define STATUS_LINES (int)(sizeof(status_lines) / sizeof(status_lines[0]))
+
+static const struct status_line *find_status_line(int code)
+{
+    for(int i = 0; i < STATUS_LINES - 1; i++) {
+        if(status_lines[i].code == code)
+            return &status_lines[i];
+    }
+    return &status_lines[STATUS_LINES - 1];
+}
+
+/*
+ * The Connection header and the blank line that end the head of every
+ * response, telling the client whether it may send another request on the
+ * same connection
+ */
+static const struct str_view header_ends[] = {
+    { "Connection: close\r\n\r\n", (int)sizeof("Connection: close\r\n\r\n") - 1 },
+    { "Connection: keep-alive\r\n\r\n", (int)sizeof("Connection: keep-alive\r\n\r\n") - 1 },
+};
+
+static const struct str_view *header_end(struct conn *c)
+{
+    return &header_ends[c->keep_alive ? 1 : 0];
+}
+
+// longest "Content-Length: <off_t>\r\n"
+#define CONTENT_LENGTH_SIZE 40
+
+/*
+ * Writes the Content-Length header into buf, which holds
+ * CONTENT_LENGTH_SIZE bytes. Returns its length.
+ */
+static int content_length_header(char *buf, long long length)
+{
+    static const char name[] = "Content-Length: ";
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = '0' + length % 10;
+        length /= 10;
+    } while(length > 0);
+
+    int len = sizeof(name) - 1;
+    memcpy(buf, name, len);
+    while(count > 0)
+        buf[len++] = digits[--count];
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
+/*
+ * Counts what a write to the client got out
+ */
+static inline void sent(ssize_t bytes_written)
+{
+    if(bytes_written > 0)
+        stats_add(STAT_BYTES_OUT, bytes_written);
+}
+
+/*
+ * Writes an iovec array to the client with sendmsg(), going on after short
+ * writes. flags is passed on, MSG_MORE tells the kernel that the body
+ * follows with the next call, so a head that goes out in front of a
+ * sendfile() shares its packet with the start of the body. Returns -1 on
+ * an unrecoverable error.
+ */
+static int sendmsg_all(struct conn *c, struct iovec *iov, int count, int flags)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    while(count > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        conn_deadline(c, DEADLINE_SEND);
+        ssize_t bytes_written = sendmsg(c->fd, &msg, flags);
+        if(bytes_written < 0) {
+            if(errno == EINTR)
+                continue;
+            warn("Unrecoverable write error");
+            return -1;
+        }
+        sent(bytes_written);
+
+        // skip what has been written, which may end inside an iovec
+        while(count > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes a response with a short message as its body. headers holds any
+ * header lines the response needs on top of the usual ones. The pieces go
+ * out together with a single sendmsg().
+ */
+static void send_response(struct conn *c, int code, const char *headers, const char *message)
+{
+    const struct status_line *status = find_status_line(code);
+    const struct str_view *end = header_end(c);
+    int message_len = strlen(message);
+    char length[CONTENT_LENGTH_SIZE];
+
+    struct iovec iov[6];
+    iov[0].iov_base = (void *)status->line;
+    iov[0].iov_len = status->len;
+    iov[1].iov_base = (void *)headers;
+    iov[1].iov_len = strlen(headers);
+    iov[2].iov_base = length;
+    iov[2].iov_len = content_length_header(length, message_len + 2);
+    iov[3].iov_base = (void *)end->data;
+    iov[3].iov_len = end->len;
+    iov[4].iov_base = (void *)message;
+    iov[4].iov_len = message_len;
+    iov[5].iov_base = (void *)"\r\n";
+    iov[5].iov_len = 2;
+
+    stats_status(code);
+    if(sendmsg_all(c, iov, 6, 0) < 0)
+        c->keep_alive = 0;
+}
+
 /*
  * base_response
  *
  * This function is called by other functions to write a given HTTP code to
- * a file descriptor. The functions below call this function.
+ * a connection. The functions below call this function. Closing the
+ * connection is left to the worker, which knows about keep-alive.
  */
-void base_response(int fd, int code, const char *status, const char *message, int _close)
+void base_response(struct conn *c, int code, const char *message)
 {
-    char reply[512];
-    snprintf(reply,
-      512,
-      "HTTP/1.1 %d %s\r\n"
-      "Content-Length: %d\r\n"
-      "\r\n"
-      "%s\r\n",
-      code,
-      status,
-      (int)strlen(message) + 2,
-      message);
-
-    write(fd, reply, strlen(reply));
-    if(_close)
-        close(fd);
+    send_response(c, code, "", message);
 }
 
 /*
  * HTTP 200
  */
-void ok(int fd, const char *message, int close)
+void ok(struct conn *c, const char *message)
+{
+    base_response(c, 200, message);
+}
+
+/*
+ * Writes the date of t the way HTTP wants it into buf
+ */
+static void http_date(char *buf, int size, time_t t)
 {
-    base_response(fd, 200, "OK", message, close);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Works out the validators of a file from its stat info. The ETag changes
+ * whenever the file is replaced (inode), written (mtime) or resized.
+ */
+static void make_validators(const struct stat *st, struct validators *v)
+{
+    snprintf(v->etag,
+      sizeof(v->etag),
+      "\"%llx-%llx-%llx\"",
+      (unsigned long long)st->st_ino,
+      (unsigned long long)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+      (unsigned long long)st->st_size);
+    v->mtime = st->st_mtim.tv_sec;
+}
+
+/*
+ * Writes the ETag and Last-Modified headers into buf. Returns their length.
+ */
+static int validator_headers(char *buf, int size, const struct validators *v)
+{
+    char date[32];
+    http_date(date, sizeof(date), v->mtime);
+    return snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, date);
+}
+
+/*
+ * Writes the status line, validators and Content-Length of a 200 response
+ * into buf, which is everything but the Connection header. Returns its
+ * length.
+ */
+static int payload_header(char *buf, int size, off_t length, const struct validators *v)
+{
+    const struct status_line *status = find_status_line(200);
+    if(size < status->len + 128 + CONTENT_LENGTH_SIZE)
+        return 0;
+
+    int len = status->len;
+    memcpy(buf, status->line, len);
+    len += validator_headers(buf + len, 128, v);
+    len += content_length_header(buf + len, length);
+    return len;
 }
 
 /*
  * HTTP 200 - write content length header for
- * GET request
+ * GET request. The header is sent with MSG_MORE, so it goes out together
+ * with the start of the body the caller sends next. Returns -1 if it could
+ * not be sent.
  */
-void ok_send_payload(int fd, int length)
+int ok_send_payload(struct conn *c, off_t length, const struct validators *v)
 {
-    char reply[512];
-    snprintf(reply,
-      512,
-      "HTTP/1.1 200 OK\r\n"
-      "Content-Length: %d\r\n"
-      "\r\n",
-      (int)length);
+    char head[256];
+    const struct str_view *end = header_end(c);
+
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = payload_header(head, sizeof(head), length, v);
+    iov[1].iov_base = (void *)end->data;
+    iov[1].iov_len = end->len;
+
+    stats_status(200);
+    return sendmsg_all(c, iov, 2, length > 0 ? MSG_MORE : 0);
+}
 
-    write(fd, reply, strlen(reply));
+/*
+ * HTTP 304 - the client's copy is still current, so there is no body
+ */
+void not_modified(struct conn *c, const struct validators *v)
+{
+    const struct status_line *status = find_status_line(304);
+    const struct str_view *end = header_end(c);
+    char validators[128];
+
+    struct iovec iov[3];
+    iov[0].iov_base = (void *)status->line;
+    iov[0].iov_len = status->len;
+    iov[1].iov_base = validators;
+    iov[1].iov_len = validator_headers(validators, sizeof(validators), v);
+    iov[2].iov_base = (void *)end->data;
+    iov[2].iov_len = end->len;
+
+    stats_status(304);
+    if(sendmsg_all(c, iov, 3, 0) < 0)
+        c->keep_alive = 0;
 }
 
 /*
  * HTTP 201
  */
-void created(int fd, const char *message)
+void created(struct conn *c, const char *message)
 {
-    base_response(fd, 201, "Created", message, 1);
+    base_response(c, 201, message);
 }
 
 /*
  * HTTP 400
  */
-void bad_request(int fd, const char *message)
+void bad_request(struct conn *c, const char *message)
 {
-    base_response(fd, 400, "Bad Request", message, 1);
+    base_response(c, 400, message);
 }
 
 /*
  * HTTP 403
  */
-void forbidden(int fd, const char *message)
+void forbidden(struct conn *c, const char *message)
 {
-    base_response(fd, 403, "Forbidden", message, 1);
+    base_response(c, 403, message);
 }
 
 /*
  * HTTP 404
  */
-void not_found(int fd, const char *message)
+void not_found(struct conn *c, const char *message)
+{
+    base_response(c, 404, message);
+}
+
+/*
+ * HTTP 416 - none of the requested ranges lie inside the file
+ */
+void range_not_satisfiable(struct conn *c, off_t size)
 {
-    base_response(fd, 404, "Not Found", message, 1);
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", (long long)size);
+    send_response(c, 416, headers, "Requested range not satisfiable");
 }
 
 /*
  * HTTP 500
  */
-void internal_server_error(int fd, const char *message)
+void internal_server_error(struct conn *c, const char *message)
+{
+    base_response(c, 500, message);
+}
+
+/*
+ * HTTP 501
+ */
+void not_implemented(struct conn *c, const char *message)
+{
+    base_response(c, 501, message);
+}
+
+/*
+ * Sends bytes start up to end of filefd to the client with sendfile(),
+ * which avoids copying the data through userspace. Returns the offset it
+ * got to. That is less than end if sendfile() does not support this kind
+ * of file, in which case the caller copies the rest. Returns -1 on an
+ * unrecoverable error.
+ *
+ * A blocking sendfile() only returns once all of its bytes are out, so the
+ * file goes in pieces of SEND_CHUNK, and the send deadline is pushed back
+ * after each one for a client that keeps taking them.
+ */
+static off_t send_file_zero_copy(struct conn *c, int filefd, off_t start, off_t end)
 {
-    base_response(fd, 500, "Internal Server Error", message, 1);
+    off_t offset = start;
+    while(offset < end) {
+        conn_deadline(c, DEADLINE_SEND);
+        ssize_t bytes_sent = sendfile(c->fd, filefd, &offset, end - offset < SEND_CHUNK ? end - offset : SEND_CHUNK);
+        if(bytes_sent > 0) {
+            sent(bytes_sent);
+            continue;
+        }
+
+        if(bytes_sent < 0 && errno == EINTR)
+            continue;
+
+        if(bytes_sent < 0 && offset == start && (errno == EINVAL || errno == ENOSYS))
+            break; // fall back to copying
+
+        if(bytes_sent == 0)
+            warnx("File shrank while it was being sent");
+        else
+            warn("Unrecoverable sendfile error");
+        return -1;
+    }
+
+    return offset;
+}
+
+/*
+ * Sends the bytes of filefd from offset up to length by reading them into a
+ * buffer and writing them to the client. Returns -1 on an unrecoverable
+ * error.
+ */
+static int send_file_copy(struct conn *c, int filefd, off_t offset, off_t length)
+{
+    char buf[BUF_SIZE];
+    int bytes_read, bytes_written;
+
+    // filefd may be shared through the fd cache, so never move its offset
+    while(offset < length) { // read and write into buffer
+        bytes_read = pread(filefd, buf, length - offset < BUF_SIZE ? length - offset : BUF_SIZE, offset);
+        if(bytes_read <= 0) {
+            if(bytes_read == 0)
+                warnx("File shrank while it was being sent");
+            else
+                warn("Unrecoverable read error");
+            return -1;
+        }
+        offset += bytes_read;
+        conn_deadline(c, DEADLINE_SEND);
+        bytes_written = write(c->fd, buf, bytes_read);
+        if(bytes_written == -1) {
+            warn("Unrecoverable write error");
+            return -1;
+        }
+        sent(bytes_written);
+    }
+
+    return 0;
+}
+
+/*
+ * Sends bytes start up to end of filefd, with sendfile() if it can.
+ * Returns -1 on an unrecoverable error.
+ */
+static int send_file_range(struct conn *c, int filefd, off_t start, off_t end)
+{
+    // let the kernel move the file straight to the socket, and only copy
+    // it through a buffer if sendfile() cannot handle this file
+    off_t offset = send_file_zero_copy(c, filefd, start, end);
+    if(offset < 0)
+        return -1;
+    return send_file_copy(c, filefd, offset, end);
+}
+
+/*
+ * HTTP 200 - answers GET /__stats with the server's statistics as JSON
+ */
+void send_stats(struct conn *c)
+{
+    static const char content_type[] = "Content-Type: application/json\r\n";
+    const struct status_line *status = find_status_line(200);
+    const struct str_view *end = header_end(c);
+    char body[16384];
+    char content_length[CONTENT_LENGTH_SIZE];
+    int body_len = stats_report(body, sizeof(body), 1);
+
+    struct iovec iov[5];
+    iov[0].iov_base = (void *)status->line;
+    iov[0].iov_len = status->len;
+    iov[1].iov_base = (void *)content_type;
+    iov[1].iov_len = sizeof(content_type) - 1;
+    iov[2].iov_base = content_length;
+    iov[2].iov_len = content_length_header(content_length, body_len);
+    iov[3].iov_base = (void *)end->data;
+    iov[3].iov_len = end->len;
+    iov[4].iov_base = body;
+    iov[4].iov_len = body_len;
+
+    stats_status(200);
+    if(sendmsg_all(c, iov, 5, 0) < 0)
+        c->keep_alive = 0;
+}
+
+/*
+ * Answers a GET from a file held in the object cache, header and body
+ * going out with a single sendmsg()
+ */
+static void send_object(struct conn *c, struct obj_entry *obj)
+{
+    const struct str_view *end = header_end(c);
+    struct iovec iov[3];
+    iov[0].iov_base = obj->header;
+    iov[0].iov_len = obj->header_len;
+    iov[1].iov_base = (void *)end->data;
+    iov[1].iov_len = end->len;
+    iov[2].iov_base = obj->body;
+    iov[2].iov_len = obj->body_len;
+
+    stats_status(200);
+    if(sendmsg_all(c, iov, 3, 0) < 0)
+        c->keep_alive = 0;
+}
+
+/*
+ * Whether an If-None-Match list names the ETag. The weak comparison is
+ * used, which is what RFC 7232 asks for with GET.
+ */
+static int etag_listed(struct str_view list, const char *etag)
+{
+    const char *p = list.data;
+    const char *end = list.data + list.len;
+    int etag_len = strlen(etag);
+
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *tag = p;
+        while(p < end && *p != ',')
+            p++;
+        const char *tag_end = p;
+        while(tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            tag_end--;
+
+        if(tag_end - tag == 1 && *tag == '*')
+            return 1;
+        if(tag_end - tag > 2 && tag[0] == 'W' && tag[1] == '/')
+            tag += 2;
+        if(tag_end - tag == etag_len && !memcmp(tag, etag, etag_len))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the copy the client already has is still current, going by
+ * If-None-Match or, when that was not sent, If-Modified-Since
+ */
+static int still_current(const struct http_request *req, const struct validators *v)
+{
+    if(req->if_none_match.len > 0)
+        return etag_listed(req->if_none_match, v->etag);
+
+    if(req->if_modified_since.len > 0 && req->if_modified_since.len < 64) {
+        char date[64];
+        struct tm tm;
+        memcpy(date, req->if_modified_since.data, req->if_modified_since.len);
+        date[req->if_modified_since.len] = '\0';
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if(rest != NULL && *rest == '\0') // other date formats are ignored
+            return v->mtime <= timegm(&tm);
+    }
+
+    return 0;
+}
+
+// separates the parts of a multipart/byteranges body
+#define RANGE_BOUNDARY "3f9c2e7a51d84b06"
+
+static const char multipart_type[] = "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n";
+static const char range_closing[] = "\r\n--" RANGE_BOUNDARY "--\r\n";
+
+/*
+ * Answers a GET that asked for parts of a file with 206 Partial Content.
+ * One range is sent as it is, several as multipart/byteranges. The bytes
+ * come from obj if the file is in the object cache, otherwise straight
+ * from filefd, where the file starts at base. Only the requested bytes are
+ * read.
+ */
+static void send_ranges(struct conn *c,
+  struct obj_entry *obj,
+  int filefd,
+  off_t base,
+  off_t size,
+  const struct validators *v,
+  struct byte_range *ranges,
+  int count)
+{
+    const struct status_line *status = find_status_line(206);
+    const struct str_view *end = header_end(c);
+    char validators[128];
+    char content_range[96];
+    char content_length[CONTENT_LENGTH_SIZE];
+    char parts[MAX_RANGES][96];
+    int part_len[MAX_RANGES];
+    int closing_len = 0;
+    long long length = 0;
+
+    // the head goes out as the prebuilt pieces and the few that depend on
+    // the request
+    struct iovec iov[2 * MAX_RANGES + 6];
+    int n = 0;
+    iov[n].iov_base = (void *)status->line;
+    iov[n++].iov_len = status->len;
+    iov[n].iov_base = validators;
+    iov[n++].iov_len = validator_headers(validators, sizeof(validators), v);
+
+    if(count == 1) {
+        length = ranges[0].end - ranges[0].start;
+        iov[n].iov_base = content_range;
+        iov[n++].iov_len = snprintf(content_range,
+          sizeof(content_range),
+          "Content-Range: bytes %lld-%lld/%lld\r\n",
+          (long long)ranges[0].start,
+          (long long)ranges[0].end - 1,
+          (long long)size);
+        part_len[0] = 0;
+    } else {
+        for(int i = 0; i < count; i++) {
+            part_len[i] = snprintf(parts[i],
+              sizeof(parts[i]),
+              "\r\n--" RANGE_BOUNDARY "\r\n"
+              "Content-Range: bytes %lld-%lld/%lld\r\n"
+              "\r\n",
+              (long long)ranges[i].start,
+              (long long)ranges[i].end - 1,
+              (long long)size);
+            length += part_len[i] + ranges[i].end - ranges[i].start;
+        }
+        closing_len = sizeof(range_closing) - 1;
+        length += closing_len;
+
+        iov[n].iov_base = (void *)multipart_type;
+        iov[n++].iov_len = sizeof(multipart_type) - 1;
+    }
+
+    iov[n].iov_base = content_length;
+    iov[n++].iov_len = content_length_header(content_length, length);
+    iov[n].iov_base = (void *)end->data;
+    iov[n++].iov_len = end->len;
+
+    stats_status(206);
+
+    // a cached file goes out with one sendmsg(), with the part headers in
+    // between the slices of the body. Otherwise each head goes out with
+    // MSG_MORE, to share a packet with the slice that is sent after it.
+    for(int i = 0; i < count; i++) {
+        if(part_len[i] > 0) {
+            iov[n].iov_base = parts[i];
+            iov[n++].iov_len = part_len[i];
+        }
+
+        if(obj == NULL) {
+            if(sendmsg_all(c, iov, n, MSG_MORE) < 0
+               || send_file_range(c, filefd, base + ranges[i].start, base + ranges[i].end) < 0) {
+                c->keep_alive = 0;
+                return;
+            }
+            n = 0;
+        } else {
+            iov[n].iov_base = obj->body + ranges[i].start;
+            iov[n++].iov_len = ranges[i].end - ranges[i].start;
+        }
+    }
+    if(closing_len > 0) {
+        iov[n].iov_base = (void *)range_closing;
+        iov[n++].iov_len = closing_len;
+    }
+
+    if(sendmsg_all(c, iov, n, 0) < 0)
+        c->keep_alive = 0;
 }
 
 /*
  * This function replies to a GET request made by the client.
  */
-void get(int fd, char *resource)
+void get(struct conn *c, char *resource)
 {
     char errbuf[140];
 
     // respond 400 if filename is not valid
     if(!valid_filename(resource)) {
         log_error("GET", resource, 400);
-        bad_request(fd, "Invalid resource name");
+        bad_request(c, "Invalid resource name");
         return;
     }
 
-    if(access(resource, F_OK) != -1) {
+    // small hot files are answered from memory without touching the disk
+    unsigned generation = 0;
+    struct obj_entry *obj = objcache_lookup(resource, &generation);
+    struct cached_file file;
+    struct validators v;
+    file.fd = -1;
+
+    if(obj == NULL) {
+        // one open() tells a missing file from an unreadable one, and the
+        // fd cache can skip even that for hot resources
+        int error = fdcache_open(resource, &file);
+        if(error == ENOENT) {
+            not_found(c, "Resource not available");
+            return;
+        }
+
         // respond 403 if server does not have permission to read file
-        if(access(resource, R_OK) == -1) {
+        if(error == EACCES) {
             log_error("GET", resource, 403);
-            forbidden(fd, "No permission to read");
+            forbidden(c, "No permission to read");
             return;
         }
 
-        // read from file into buffer
-        int filefd = open(resource, O_RDONLY);
-        if(filefd < 0) {
+        if(error != 0) {
             log_error("GET", resource, 500);
-            char *err_msg = strerror_r(errno, errbuf, 140);
-            internal_server_error(fd, err_msg);
+            char *err_msg = strerror_r(error, errbuf, 140);
+            internal_server_error(c, err_msg);
             return;
         }
 
+        make_validators(&file.st, &v);
+
+        // read files that fit into the object cache, so the next GET is a hit
+        if(objcache_enabled()) {
+            char header[256];
+            int header_len = payload_header(header, sizeof(header), file.st.st_size, &v);
+            obj = objcache_load(resource, generation, file.fd, file.offset, file.st.st_size, v.etag, v.mtime, header, header_len);
+        }
+    } else {
+        snprintf(v.etag, sizeof(v.etag), "%s", obj->etag);
+        v.mtime = obj->mtime;
+    }
+
+    off_t content_length = obj ? (off_t)obj->body_len : file.st.st_size;
+
+    // the client's copy is checked before looking at ranges
+    struct byte_range ranges[MAX_RANGES];
+    int current = still_current(&c->parser.req, &v);
+    int count = current ? 0 : parse_ranges(c->parser.req.range, content_length, ranges);
+
+    if(current) {
+        log("GET", resource, 0);
+        not_modified(c, &v);
+    } else if(count < 0) {
+        log_error("GET", resource, 416);
+        range_not_satisfiable(c, content_length);
+    } else {
         log("GET", resource, 0);
 
-        char buf[BUF_SIZE];
-        int bytes_read, bytes_written, total_bytes_read;
-        bytes_read = bytes_written = total_bytes_read = 0;
-        struct stat st;
-        fstat(filefd, &st); // get size of the file for content length
-        int content_length = st.st_size;
-        ok_send_payload(fd, content_length);
-
-        do { // read and write into buffer
-            bytes_read = read(filefd, buf, BUF_SIZE);
-            if(bytes_read == -1) {
-                // basically an unrecoverable error and we need to give up since we have
-                // already written to log
-                warn("Unrecoverable read error");
-                close(fd);
-                close(filefd);
-                return;
+        if(count > 0) {
+            send_ranges(c, obj, file.fd, file.offset, content_length, &v, ranges, count);
+        } else if(obj != NULL) {
+            send_object(c, obj);
+        } else {
+            if(ok_send_payload(c, content_length, &v) < 0
+               || send_file_range(c, file.fd, file.offset, file.offset + content_length) < 0) {
+                // basically an unrecoverable error and we need to give up since
+                // we have already written to log
+                c->keep_alive = 0;
             }
-            total_bytes_read += bytes_read;
-            bytes_written = write(fd, buf, bytes_read);
-            if(bytes_written == -1) { // same here
+        }
+    }
+
+    if(obj != NULL)
+        objcache_release(obj);
+    if(file.fd >= 0)
+        fdcache_close(&file);
+}
+
+/*
+ * Returns the pipe this worker thread uses to splice request bodies, and
+ * creates it on first use. The pipe is made as large as the system allows
+ * so that each splice() can move more than the default 64 KB.
+ */
+static int *splice_pipe()
+{
+    static thread_local int pipefd[2] = { -1, -1 };
+    if(pipefd[0] < 0) {
+        if(pipe2(pipefd, O_CLOEXEC) < 0) {
+            pipefd[0] = pipefd[1] = -1;
+            return NULL;
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+    }
+    return pipefd;
+}
+
+/*
+ * Throws the worker's pipe away after an error, since it may still hold
+ * bytes of the failed request
+ */
+static void splice_pipe_discard(int *pipefd)
+{
+    close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+/*
+ * Moves a request body from the socket into filefd through a pipe with
+ * splice(), so the bytes never enter userspace. Bytes that were buffered
+ * with the headers are written first. With length < 0 it behaves like the
+ * buffered loop in put() and stops at the first short read.
+ *
+ * The amount of body bytes stored is kept in *received. Returns 1 when the
+ * body is complete, 0 if splice() cannot be used and the caller has to read
+ * the rest itself, and -1 on an unrecoverable error.
+ */
+static int recv_file_zero_copy(struct conn *c, int filefd, int length, int *received)
+{
+    *received = 0;
+
+    // the unknown length loop stops at the first short read, which buffered
+    // bytes would be, so leave those to it
+    int buffered = c->len - c->start;
+    if(length < 0 && buffered > 0)
+        return 0;
+
+    if(buffered > 0) {
+        if(buffered > length)
+            buffered = length;
+        if(write(filefd, c->buf + c->start, buffered) != buffered) {
+            warn("Unrecoverable write error");
+            return -1;
+        }
+        c->start += buffered;
+        *received = buffered;
+    }
+
+    int *pipefd = splice_pipe();
+    if(pipefd == NULL)
+        return 0;
+
+    for(;;) {
+        int chunk = BUF_SIZE;
+        if(length >= 0) {
+            if(*received == length)
+                return 1;
+            chunk = length - *received;
+        }
+
+        conn_deadline(c, DEADLINE_BODY);
+        ssize_t in_pipe = splice(c->fd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in_pipe < 0 && errno == EINTR)
+            continue;
+        // the caller reads on from *received, which counts the buffered
+        // bytes already stored
+        if(in_pipe < 0 && (errno == EINVAL || errno == ENOSYS))
+            return 0; // fall back to read()
+        if(in_pipe < 0 || (in_pipe == 0 && length >= 0)) {
+            if(in_pipe == 0)
+                errno = ECONNRESET; // the client went away or its deadline shut the socket
+            warn("Unrecoverable read error");
+            splice_pipe_discard(pipefd);
+            return -1;
+        }
+        stats_add(STAT_BYTES_IN, in_pipe);
+
+        ssize_t left = in_pipe;
+        while(left > 0) {
+            ssize_t out_pipe = splice(pipefd[0], NULL, filefd, NULL, left, SPLICE_F_MOVE);
+            if(out_pipe < 0 && errno == EINTR)
+                continue;
+            if(out_pipe <= 0) {
                 warn("Unrecoverable write error");
-                close(fd);
-                close(filefd);
-                return;
+                splice_pipe_discard(pipefd);
+                return -1;
+            }
+            left -= out_pipe;
+        }
+        *received += in_pipe;
+
+        if(length < 0 && in_pipe < BUF_SIZE)
+            return 1;
+    }
+}
+
+/*
+ * Receives the rest of a request body of length bytes into filefd and logs
+ * it through the worker's io_uring. Writing a chunk to the file and to the
+ * log goes to the kernel together with receiving the next chunk, so each
+ * chunk takes one io_uring_enter() instead of a read(), a write() and a
+ * pwrite(). *received holds the body bytes already stored and *offset the
+ * log offset of the next chunk. The body is added to hash unless that is
+ * NULL. Returns -1 on an unrecoverable error.
+ */
+static int recv_file_uring(struct conn *c, int filefd, int length, int *received, int *offset, struct sha256_ctx *hash)
+{
+    char *chunk[2] = { uring_buffer(0), uring_buffer(1) };
+    char *text = uring_buffer(2);
+    int current = 0;
+    int results[4];
+
+    // bytes that came in with the headers are the first chunk
+    int bytes_read = c->len - c->start;
+    if(bytes_read > length - *received)
+        bytes_read = length - *received;
+    memcpy(chunk[0], c->buf + c->start, bytes_read);
+    c->start += bytes_read;
+
+    for(;;) {
+        int file_op = -1, log_op = -1, recv_op = -1, ops = 0, log_len = 0;
+        if(bytes_read > 0) {
+            *received += bytes_read;
+            uring_write_fixed(filefd, current, chunk[current], bytes_read, *received - bytes_read);
+            file_op = ops++;
+            if(hash)
+                sha256_update(hash, chunk[current], bytes_read);
+
+            if(*offset >= 0 && log_binary) {
+                log_len = bytes_read;
+                uring_write_log(current, chunk[current], log_len, *offset);
+                log_op = ops++;
+            } else if(*offset >= 0) {
+                log_len = hexdump_format(text, chunk[current], bytes_read, *received - bytes_read);
+                uring_write_log(2, text, log_len, *offset);
+                log_op = ops++;
             }
-        } while(total_bytes_read < content_length);
+        }
 
-        // use 200 OK function to send payload to fd
-        close(fd);
-        close(filefd);
+        int next = 1 - current;
+        if(*received < length) {
+            int want = length - *received < BUF_SIZE ? length - *received : BUF_SIZE;
+            conn_deadline(c, DEADLINE_BODY);
+            uring_recv(c->fd, chunk[next], want);
+            recv_op = ops++;
+        }
+
+        if(uring_submit(results) < 0) {
+            warn("io_uring");
+            return -1;
+        }
+
+        if(file_op >= 0 && results[file_op] != bytes_read) {
+            errno = results[file_op] < 0 ? -results[file_op] : EIO;
+            warn("Unrecoverable write error");
+            return -1;
+        }
+        if(log_op >= 0 && results[log_op] != log_len) {
+            errno = results[log_op] < 0 ? -results[log_op] : EIO;
+            warn("Could not write to log");
+            *offset = -1;
+        } else if(log_op >= 0) {
+            *offset += log_len;
+        }
+
+        if(recv_op < 0)
+            return 0;
+        if(results[recv_op] <= 0) {
+            errno = results[recv_op] < 0 ? -results[recv_op] : ECONNRESET;
+            warn("Unrecoverable read error");
+            return -1;
+        }
+        bytes_read = results[recv_op];
+        stats_add(STAT_BYTES_IN, bytes_read);
+        current = next;
+    }
+}
+
+/*
+ * Reads more of a chunked body into the connection buffer once all of it
+ * has been decoded. The head in front of the body has to stay where it is,
+ * because the resource name still points into it, so the new bytes go
+ * right behind it. Returns -1 if nothing could be read.
+ */
+static int refill_body(struct conn *c)
+{
+    int head_len = c->parser.req.head_len;
+    if(head_len >= BUF_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    c->start = c->len = head_len;
+
+    int bytes_read;
+    conn_deadline(c, DEADLINE_BODY);
+    if(uring_active()) {
+        uring_recv(c->fd, c->buf + head_len, BUF_SIZE - head_len);
+        if(uring_submit(&bytes_read) < 0)
+            return -1;
+        if(bytes_read < 0) {
+            errno = -bytes_read;
+            return -1;
+        }
     } else {
-        not_found(fd, "Resource not available");
+        do {
+            bytes_read = read(c->fd, c->buf + head_len, BUF_SIZE - head_len);
+        } while(bytes_read < 0 && errno == EINTR);
+        if(bytes_read < 0)
+            return -1;
     }
+
+    if(bytes_read == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    stats_add(STAT_BYTES_IN, bytes_read);
+    c->len += bytes_read;
+    return 0;
 }
 
 /*
- * This function replies to a PUT request made by the client.
+ * Receives a body sent with Transfer-Encoding: chunked into filefd. Chunks
+ * are decoded right in the connection buffer and written out as they
+ * arrive, so the body is never held in memory as a whole. Bytes after the
+ * last chunk are left in the buffer for the next request. The amount of
+ * body bytes stored is kept in *received, and the body is added to hash
+ * unless that is NULL. Returns -1 on a read or write error and -2 if the
+ * body is malformed.
  */
-void put(int fd, char *resource, int content_length)
+static int recv_file_chunked(struct conn *c, int filefd, int *received, struct sha256_ctx *hash)
+{
+    struct chunked_decoder decoder;
+    chunked_init(&decoder);
+    *received = 0;
+
+    while(!chunked_done(&decoder)) {
+        if(c->start == c->len && refill_body(c) < 0) {
+            warn("Unrecoverable read error");
+            return -1;
+        }
+
+        int data_start, data_len;
+        char *in = c->buf + c->start;
+        int used = chunked_decode(&decoder, in, c->len - c->start, &data_start, &data_len);
+        if(used < 0)
+            return -2;
+        if(data_len > 0 && *received > INT_MAX - data_len) // the log counts in ints
+            return -2;
+
+        int written = 0;
+        while(written < data_len) {
+            ssize_t bytes_written = write(filefd, in + data_start + written, data_len - written);
+            if(bytes_written < 0 && errno == EINTR)
+                continue;
+            if(bytes_written <= 0) {
+                warn("Unrecoverable write error");
+                return -1;
+            }
+            written += bytes_written;
+        }
+        if(hash)
+            sha256_update(hash, in + data_start, data_len);
+        *received += data_len;
+        c->start += used;
+    }
+
+    return 0;
+}
+
+/*
+ * Logs a PUT whose length was not known before the body had been read,
+ * which is the case for chunked uploads. The entry looks like any other
+ * PUT; the body is read back from the file it was stored in, so the log
+ * records exactly what was written.
+ */
+static int log_stored_put(char *resource, int filefd, int length)
+{
+    int offset = log("PUT", resource, length);
+
+    char buf[BUF_SIZE];
+    int logged = 0;
+    while(offset >= 0 && logged < length) {
+        int want = length - logged < BUF_SIZE ? length - logged : BUF_SIZE;
+        ssize_t bytes_read = pread(filefd, buf, want, logged);
+        if(bytes_read <= 0) {
+            if(bytes_read == 0)
+                errno = EIO; // the temporary file is shorter than the body
+            warn("Could not read back PUT body");
+            return -1;
+        }
+        logged += bytes_read;
+        offset = log_body(bytes_read, logged, offset, buf);
+    }
+
+    return offset;
+}
+
+/*
+ * Creates the temporary file a PUT of resource is written to, in the same
+ * directory so that it can be renamed over the resource. Its name starts
+ * with a dot, which no valid resource name does. The name is stored in
+ * temp.
+ */
+static int open_temp(const char *resource, char *temp, int size)
+{
+    snprintf(temp, size, ".%s.XXXXXX", resource);
+    int filefd = mkostemp(temp, O_CLOEXEC);
+    if(filefd >= 0)
+        fchmod(filefd, 0644);
+    return filefd;
+}
+
+/*
+ * Throws away the temporary file of a PUT that did not complete, leaving
+ * the resource as it was
+ */
+static void discard_temp(int filefd, const char *temp)
+{
+    close(filefd);
+    unlink(temp);
+}
+
+/*
+ * Writes len bytes of buf at offset of filefd, going on after short
+ * writes. Returns -1 on an error.
+ */
+static int pwrite_file(int filefd, const char *buf, int len, off_t offset)
+{
+    while(len > 0) {
+        ssize_t bytes_written = pwrite(filefd, buf, len, offset);
+        if(bytes_written < 0 && errno == EINTR)
+            continue;
+        if(bytes_written <= 0)
+            return -1;
+        buf += bytes_written;
+        len -= bytes_written;
+        offset += bytes_written;
+    }
+
+    return 0;
+}
+
+/*
+ * Receives a body of length bytes into filefd, which was opened with
+ * O_DIRECT. The body is gathered in an aligned buffer of the worker thread
+ * and written out in large aligned pieces, so it bypasses the page cache.
+ * Only the tail that does not fill a whole block goes through the cache.
+ * *received holds the body bytes stored and *offset the log offset of the
+ * next chunk. The body is added to hash unless that is NULL. Returns -1 on
+ * an unrecoverable error.
+ */
+static int recv_file_direct(struct conn *c, int filefd, int length, int *received, int *offset, struct sha256_ctx *hash)
+{
+    static thread_local char *buf = NULL;
+    if(buf == NULL && posix_memalign((void **)&buf, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+        buf = NULL;
+        warn("Could not allocate aligned buffer");
+        return -1;
+    }
+
+    off_t stored = 0; // bytes already written to the file
+    int filled = 0;   // bytes waiting in buf
+    while(*received < length) {
+        int want = length - *received;
+        if(want > BUF_SIZE)
+            want = BUF_SIZE;
+        if(want > DIRECT_BUF_SIZE - filled)
+            want = DIRECT_BUF_SIZE - filled;
+
+        int bytes_read = conn_read(c, buf + filled, want);
+        if(bytes_read <= 0) {
+            warn("Unrecoverable read error");
+            return -1;
+        }
+        *received += bytes_read;
+        *offset = log_body(bytes_read, *received, *offset, buf + filled);
+        if(hash)
+            sha256_update(hash, buf + filled, bytes_read);
+        filled += bytes_read;
+
+        if(filled == DIRECT_BUF_SIZE) {
+            if(pwrite_file(filefd, buf, filled, stored) < 0) {
+                warn("Unrecoverable write error");
+                return -1;
+            }
+            stored += filled;
+            filled = 0;
+        }
+    }
+
+    // O_DIRECT only writes whole blocks, so the last partial one is written
+    // through the page cache
+    int whole = filled & ~(DIRECT_ALIGN - 1);
+    if(pwrite_file(filefd, buf, whole, stored) < 0
+       || fcntl(filefd, F_SETFL, fcntl(filefd, F_GETFL) & ~O_DIRECT) < 0
+       || pwrite_file(filefd, buf + whole, filled - whole, stored + whole) < 0) {
+        warn("Unrecoverable write error");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stores the body of a PUT and answers it
+ */
+static void store_put(struct conn *c, char *resource, int content_length)
 {
     char errbuf[140];
 
-    // the server will only wait for connections from the client for
-    // five seconds
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+    int keep_alive = c->keep_alive;
+
+    // the request body is not read on the error paths below, so there is no
+    // telling where the next request would start
+    c->keep_alive = 0;
 
     // respond 400 if filename is not valid
     if(!valid_filename(resource)) {
         log_error("PUT", resource, 400);
-        bad_request(fd, "Invalid resource name");
-        return;
-    }
-
-    // respond 403 if server does not have permission to write to existing file
-    if(access(resource, F_OK) != -1 && access(resource, W_OK) == -1) {
-        log_error("PUT", resource, 403);
-        forbidden(fd, "No permission to write");
+        bad_request(c, "Invalid resource name");
         return;
     }
 
@@ -241,83 +1234,199 @@ void put(int fd, char *resource, int content_length)
     int bytes_read, total_bytes_read, bytes_written;
     bytes_read = bytes_written = total_bytes_read = 0;
 
-    // write from payload to file
-    int filefd = open(resource, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // the body goes to a temporary file, which only replaces the resource
+    // once it is complete, so a GET sees either the old or the new file
+    char temp[40];
+    int filefd = -1;
+    if(access(resource, W_OK) == 0 || errno == ENOENT)
+        filefd = open_temp(resource, temp, sizeof(temp));
+
+    // respond 403 if server does not have permission to write to the file
+    if(filefd < 0 && errno == EACCES) {
+        log_error("PUT", resource, 403);
+        forbidden(c, "No permission to write");
+        return;
+    }
+
     if(filefd < 0) {
         log_error("PUT", resource, 500);
         char *err_msg = strerror_r(errno, errbuf, 140);
-        internal_server_error(fd, err_msg);
+        internal_server_error(c, err_msg);
+        return;
+    }
+
+    // reserving the space up front keeps the file in few extents and turns
+    // a full disk into an error before the body is read
+    if(content_length > 0 && fallocate(filefd, 0, 0, content_length) < 0 && errno != EOPNOTSUPP) {
+        log_error("PUT", resource, 500);
+        char *err_msg = strerror_r(errno, errbuf, 140);
+        internal_server_error(c, err_msg);
+        discard_temp(filefd, temp);
         return;
     }
 
-    int offset = log("PUT", resource, content_length);
+    // very large bodies would push the files that GETs keep hot out of the
+    // page cache
+    int direct = direct_threshold > 0 && content_length >= direct_threshold
+                 && fcntl(filefd, F_SETFL, fcntl(filefd, F_GETFL) | O_DIRECT) == 0;
+
+    // the dedup store names the body by its hash, which is worked out while
+    // the body streams past
+    struct sha256_ctx hash_ctx;
+    struct sha256_ctx *hash = NULL;
+    if(store_mode() == STORE_DEDUP) {
+        hash = &hash_ctx;
+        sha256_init(hash);
+    }
+
+    // a chunked body is only logged once it is complete and its length known
+    int chunked = view_equals(c->parser.req.transfer_encoding, "chunked");
+    int offset = chunked ? -1 : log("PUT", resource, content_length);
+
+    // without a body log the bytes don't need to pass through the server,
+    // so splice them straight from the socket into the file
+    int spliced = 0;
+    if(log_fd < 0 && content_length != 0 && !chunked && !direct && !hash) {
+        spliced = recv_file_zero_copy(c, filefd, content_length, &total_bytes_read);
+        if(spliced < 0) {
+            discard_temp(filefd, temp);
+            return;
+        }
+    }
 
-    if(content_length == 0) { // write empty file
+    if(chunked) {
+        int status = recv_file_chunked(c, filefd, &total_bytes_read, hash);
+        if(status == -2) {
+            log_error("PUT", resource, 400);
+            bad_request(c, "Malformed chunked body");
+        }
+        if(status < 0) {
+            discard_temp(filefd, temp);
+            return;
+        }
+        offset = log_stored_put(resource, filefd, total_bytes_read);
+        c->keep_alive = keep_alive;
+    } else if(direct) {
+        if(recv_file_direct(c, filefd, content_length, &total_bytes_read, &offset, hash) < 0) {
+            discard_temp(filefd, temp);
+            return;
+        }
+        c->keep_alive = keep_alive;
+    } else if(spliced) {
+        // the unknown length path never keeps the connection
+        if(content_length > 0)
+            c->keep_alive = keep_alive;
+    } else if(content_length == 0) { // write empty file
         write(filefd, buf, strlen(buf));
+        c->keep_alive = keep_alive;
+    } else if(content_length > 0 && uring_active()) {
+        if(recv_file_uring(c, filefd, content_length, &total_bytes_read, &offset, hash) < 0) {
+            discard_temp(filefd, temp);
+            return;
+        }
+        c->keep_alive = keep_alive;
     } else if(content_length < 0) { // content length was unspecified
         // read data from the fd and terminate in the buffer based on
         // either the total bytes read or the value of content-length
         do {
-            bytes_read = read(fd, buf, BUF_SIZE);
+            bytes_read = conn_read(c, buf, BUF_SIZE);
             if(bytes_read == -1) { // unrecoverable
                 warn("Unrecoverable read error");
-                close(fd);
-                close(filefd);
+                discard_temp(filefd, temp);
                 return;
             }
             total_bytes_read += bytes_read;
             bytes_written = write(filefd, buf, bytes_read);
             if(bytes_written == -1) { // unrecoverable
                 warn("Unrecoverable write error");
-                close(fd);
-                close(filefd);
+                discard_temp(filefd, temp);
                 return;
             }
+            if(hash)
+                sha256_update(hash, buf, bytes_read);
             // write to log
-            offset = write_hex_to_log(bytes_read, total_bytes_read, offset, buf);
+            offset = log_body(bytes_read, total_bytes_read, offset, buf);
         } while(bytes_read == BUF_SIZE);
     } else {
         while(total_bytes_read < content_length) {
             // content length was specified so read up to the content length
             if((content_length - total_bytes_read) < BUF_SIZE)
-                bytes_read = read(fd, buf, content_length - total_bytes_read);
+                bytes_read = conn_read(c, buf, content_length - total_bytes_read);
             else
-                bytes_read = read(fd, buf, BUF_SIZE);
-            if(bytes_read == -1) { // unrecoverable
+                bytes_read = conn_read(c, buf, BUF_SIZE);
+            if(bytes_read <= 0) { // unrecoverable
                 warn("Unrecoverable read error");
-                close(fd);
-                close(filefd);
+                discard_temp(filefd, temp);
                 return;
             }
             total_bytes_read += bytes_read;
             bytes_written = write(filefd, buf, bytes_read);
             if(bytes_written == -1) { // unrecoverable
                 warn("Unrecoverable write error");
-                close(fd);
-                close(filefd);
+                discard_temp(filefd, temp);
                 return;
             }
-            offset = write_hex_to_log(bytes_read, total_bytes_read, offset, buf);
+            if(hash)
+                sha256_update(hash, buf, bytes_read);
+            offset = log_body(bytes_read, total_bytes_read, offset, buf);
         }
+
+        // the whole body was consumed, so the connection can be reused
+        c->keep_alive = keep_alive;
     }
 
-    if(offset != -1) {
+    if(offset != -1 && !log_binary) {
         char separator[] = "========\n";
         pwrite(log_fd, separator, strlen(separator), offset);
     }
 
+    unsigned char digest[SHA256_DIGEST_LEN];
+    if(hash)
+        sha256_final(hash, digest);
+    if(store_publish(resource, temp, filefd, digest) < 0) {
+        log_error("PUT", resource, 500);
+        char *err_msg = strerror_r(errno, errbuf, 140);
+        internal_server_error(c, err_msg);
+        discard_temp(filefd, temp);
+        return;
+    }
     close(filefd);
-    created(fd, resource);
+
+    // cached copies of the file that was replaced are stale now
+    fdcache_invalidate(resource);
+    objcache_invalidate(resource);
+    created(c, resource);
+}
+
+/*
+ * This function replies to a PUT request made by the client. PUTs of the
+ * same resource take turns, so the last one to publish its file is also
+ * the last one in the log.
+ */
+void put(struct conn *c, char *resource, int content_length)
+{
+    struct res_lock lock;
+    reslock_lock(&lock, resource);
+    store_put(c, resource, content_length);
+    reslock_unlock(&lock);
 }
 
 void log_get(char resource[28]);
 int log_put(char resource[28], int content_length);
+static int log_record(const char *method, const char *resource, int status, int length);
 
 /*
  * This function is used to write a successful GET or PUT to the log
  */
 int log(const char method[4], char resource[28], int content_length)
 {
+    if(log_binary) {
+        if(!strcmp(method, "PUT"))
+            return log_record(method, resource, 0, content_length);
+        log_record(method, resource, 0, 0);
+        return 0;
+    }
+
     if(!strcmp(method, "GET")) {
         log_get(resource);
         return 0;
@@ -397,49 +1506,50 @@ int log_put(char resource[28], int content_length)
     return local_log_offset;
 }
 
+/*
+ * Writes all of buf to the log at offset, going on after short writes.
+ * Returns -1 on an error.
+ */
+static int pwrite_all(const char *buf, int len, off_t offset)
+{
+    while(len > 0) {
+        ssize_t bytes_written = pwrite(log_fd, buf, len, offset);
+        if(bytes_written < 0) {
+            if(errno == EINTR)
+                continue;
+            warn("Could not write to log");
+            return -1;
+        }
+        buf += bytes_written;
+        len -= bytes_written;
+        offset += bytes_written;
+    }
+
+    return 0;
+}
+
 /*
  * This function writes bytes fron content to the log as a formatted
- * hex line
+ * hex line. The lines are put together in a buffer of the worker thread,
+ * so a chunk of the body normally takes a single pwrite().
  */
 int write_hex_to_log(int bytes_read, int total_bytes_read, int offset, char *content)
 {
-    if(log_fd < 0)
+    if(log_fd < 0 || offset < 0) // no log, or an earlier chunk failed
         return -1;
 
-    int i, j, bytes, char_cur, new_offset;
-    bytes = total_bytes_read - bytes_read; // counter of what byte # we are at
-    char_cur = 0;        // cursor pointing to the location in content that we are reading from
-    new_offset = offset; // cursor pointing to the location in the log file we are writing to
-
-    int lines = bytes_read / 20; // determine how many lines we have to write
-    if(bytes_read % 20 > 0)
-        lines++;
-
-    char byte_number_fmt[10];
-    for(i = 0; i < lines; i++) {                       // for each line we are writing to the log
-        snprintf(byte_number_fmt, 10, "%08d ", bytes); // write current byte index to file
-        new_offset += pwrite(log_fd, byte_number_fmt, strlen(byte_number_fmt), new_offset);
-        int upto = 20;
-        if(i == lines - 1) {
-            upto = bytes_read - (20 * i); // upto is how many bytes are in the line we are writing
-        }
-
-        unsigned int byte;
-        char hex_char[3];
-        for(j = 0; j < upto; j++) {
-            byte = content[char_cur++]; // cast byte to unsigned int for hex conversion
-            snprintf(hex_char, 3, "%02x", byte);
-            new_offset += pwrite(log_fd,
-              hex_char,
-              strlen(hex_char),
-              new_offset); // write a single hex digit to the file
+    static thread_local char buf[1 << 16];
+    const int batch = (sizeof(buf) - HEXDUMP_SLACK) / HEXDUMP_LINE_MAX * HEXDUMP_LINE_BYTES;
 
-            if(j < upto - 1)
-                pwrite(log_fd, " ", 1, new_offset++); // add spaces in between each hex digit
-        }
+    int bytes = total_bytes_read - bytes_read; // counter of what byte # we are at
+    int new_offset = offset; // cursor pointing to the location in the log file we are writing to
 
-        bytes += 20;                           // we are writing 20 bytes per line
-        pwrite(log_fd, "\n", 1, new_offset++); // write newline to file in between each line
+    for(int done = 0; done < bytes_read; done += batch) {
+        int len = bytes_read - done < batch ? bytes_read - done : batch;
+        int text_len = hexdump_format(buf, content + done, len, bytes + done);
+        if(pwrite_all(buf, text_len, new_offset) < 0)
+            return -1;
+        new_offset += text_len;
     }
 
     return new_offset; // return offset so PUT knows where to write the next set of bytes
@@ -453,6 +1563,11 @@ void log_error(const char method[4], char *resource, int code)
     if(log_fd < 0)
         return;
 
+    if(log_binary) {
+        log_record(method, resource, code, 0);
+        return;
+    }
+
     int size_of_first_line = 10 + strlen(resource) + 27;
     int size_of_separator = 9;
 
@@ -477,3 +1592,63 @@ void log_error(const char method[4], char *resource, int code)
     pwrite(log_fd, log_line, size_of_reservation, local_log_offset);
     free(log_line);
 }
+
+/*
+ * This function writes an entry to the binary log (-b). The record, the
+ * resource name and room for length bytes of body are reserved at once.
+ * Returns the offset the body goes to, or -1 if nothing was logged.
+ */
+static int log_record(const char *method, const char *resource, int status, int length)
+{
+    if(log_fd < 0 || length < 0)
+        return -1;
+
+    struct binlog_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = BINLOG_MAGIC;
+    record.status = status;
+    record.resource_len = strnlen(resource, UINT16_MAX);
+    strncpy(record.method, method, sizeof(record.method) - 1);
+    record.length = length;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.timestamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    int size_of_reservation = sizeof(record) + record.resource_len + length;
+    int local_log_offset;
+    pthread_mutex_lock(&log_mutex);
+    local_log_offset = log_offset;
+    log_offset += size_of_reservation;
+    pthread_mutex_unlock(&log_mutex);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)resource;
+    iov[1].iov_len = record.resource_len;
+    ssize_t header_len = sizeof(record) + record.resource_len;
+    if(pwritev(log_fd, iov, 2, local_log_offset) != header_len) {
+        warn("Could not write to log");
+        return -1;
+    }
+
+    return local_log_offset + header_len;
+}
+
+/*
+ * This function adds a chunk of a PUT body to the log entry at offset,
+ * as hex lines or as it is in the binary log. Returns the offset of the
+ * next chunk.
+ */
+int log_body(int bytes_read, int total_bytes_read, int offset, char *content)
+{
+    if(!log_binary)
+        return write_hex_to_log(bytes_read, total_bytes_read, offset, content);
+
+    if(log_fd < 0 || offset < 0)
+        return -1;
+    if(pwrite_all(content, bytes_read, offset) < 0)
+        return -1;
+    return offset + bytes_read;
+}
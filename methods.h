@@ -1,14 +1,32 @@
+#include <sys/types.h>
+#include <time.h>
+
+struct conn;
+
+/*
+ * What tells one version of a file from another, sent to clients as ETag
+ * and Last-Modified
+ */
+struct validators {
+    char etag[64];
+    time_t mtime;
+};
+
 int valid_filename(char *filename);
-void ok(int fd, const char *message, int close);
-void ok_send_payload(int fd, int length);
-void bad_request(int fd, const char *message);
-void created(int fd, const char *message);
-void bad_request(int fd, const char *message);
-void not_found(int fd, const char *message);
-void forbidden(int fd, const char *message);
-void internal_server_error(int fd, const char *message);
-void get(int fd, char *resource);
-void put(int fd, char *resource, int content_length);
+void ok(struct conn *c, const char *message);
+int ok_send_payload(struct conn *c, off_t length, const struct validators *v);
+void not_modified(struct conn *c, const struct validators *v);
+void bad_request(struct conn *c, const char *message);
+void created(struct conn *c, const char *message);
+void not_found(struct conn *c, const char *message);
+void forbidden(struct conn *c, const char *message);
+void range_not_satisfiable(struct conn *c, off_t size);
+void internal_server_error(struct conn *c, const char *message);
+void not_implemented(struct conn *c, const char *message);
+void send_stats(struct conn *c);
+void get(struct conn *c, char *resource);
+void put(struct conn *c, char *resource, int content_length);
 int log(const char method[4], char resource[28], int content_length);
 int write_hex_to_log(int bytes_read, int total_bytes_read, int offset, char *content);
+int log_body(int bytes_read, int total_bytes_read, int offset, char *content);
 void log_error(const char method[4], char *resource, int code);
@@ -0,0 +1,317 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "objcache.h"
+
+#define SHARDS 16
+#define BUCKETS_PER_SHARD 1024
+#define MAX_OBJECT (1 << 20) // larger files are always sent from disk
+
+/*
+ * The cache is split into shards by the hash of the resource name, each
+ * with its own lock, LRU list and share of the memory budget, so workers
+ * asking for different resources rarely wait on each other.
+ *
+ * Every shard has a generation that is bumped whenever one of its entries
+ * is invalidated. A GET that misses remembers the generation, reads the
+ * file, and may only insert it if the generation has not moved, so a
+ * file read while a PUT was rewriting it never makes it into the cache.
+ */
+struct shard {
+    pthread_mutex_t mutex;
+    struct obj_entry *buckets[BUCKETS_PER_SHARD];
+    struct obj_entry *lru_head;
+    struct obj_entry *lru_tail;
+    size_t bytes;
+    unsigned generation;
+    unsigned long long hits;
+    unsigned long long misses;
+} __attribute__((aligned(64)));
+
+static struct shard *shards;
+static size_t shard_budget; // 0 when the cache is off
+static size_t max_object;
+
+/*
+ * FNV-1a hash of a resource name
+ */
+static unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for(; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static struct obj_entry **bucket_of(struct shard *shard, unsigned hash)
+{
+    return &shard->buckets[(hash / SHARDS) % BUCKETS_PER_SHARD];
+}
+
+static void lru_unlink(struct shard *shard, struct obj_entry *entry)
+{
+    if(entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->lru_head = entry->next;
+    if(entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->lru_tail = entry->prev;
+}
+
+static void lru_push_front(struct shard *shard, struct obj_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->lru_head;
+    if(shard->lru_head)
+        shard->lru_head->prev = entry;
+    shard->lru_head = entry;
+    if(shard->lru_tail == NULL)
+        shard->lru_tail = entry;
+}
+
+/*
+ * Take an entry out of its shard, whose mutex must be held. Returns the
+ * entry if the cache held the last reference and it has to be freed.
+ */
+static struct obj_entry *remove_entry(struct shard *shard, struct obj_entry *entry)
+{
+    struct obj_entry **link = bucket_of(shard, hash_name(entry->name));
+    while(*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->cost;
+    return --entry->refs == 0 ? entry : NULL;
+}
+
+/*
+ * Frees a list of dead entries linked through hash_next
+ */
+static void free_entries(struct obj_entry *dead)
+{
+    while(dead != NULL) {
+        struct obj_entry *next = dead->hash_next;
+        free(dead);
+        dead = next;
+    }
+}
+
+/*
+ * Sets up a cache that holds up to bytes of file data. With 0 bytes the
+ * cache is off and every lookup misses without counting.
+ */
+void objcache_init(size_t bytes)
+{
+    shard_budget = bytes / SHARDS;
+    if(shard_budget == 0)
+        return;
+
+    // a single object may take at most a quarter of its shard
+    max_object = shard_budget / 4 < MAX_OBJECT ? shard_budget / 4 : MAX_OBJECT;
+
+    shards = (struct shard *)aligned_alloc(64, SHARDS * sizeof(struct shard));
+    if(shards == NULL)
+        err(1, "objcache_init");
+    memset(shards, 0, SHARDS * sizeof(struct shard));
+    for(int i = 0; i < SHARDS; i++)
+        pthread_mutex_init(&shards[i].mutex, NULL);
+}
+
+int objcache_enabled()
+{
+    return shard_budget > 0;
+}
+
+/*
+ * Returns a referenced entry for name, or NULL on a miss. On a miss
+ * *generation is set to what objcache_load() needs to insert the file.
+ */
+struct obj_entry *objcache_lookup(const char *name, unsigned *generation)
+{
+    if(shard_budget == 0)
+        return NULL;
+
+    unsigned hash = hash_name(name);
+    struct shard *shard = &shards[hash % SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+    struct obj_entry *entry = *bucket_of(shard, hash);
+    while(entry != NULL && strcmp(entry->name, name) != 0)
+        entry = entry->hash_next;
+
+    if(entry != NULL) {
+        entry->refs++;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        shard->hits++;
+    } else {
+        *generation = shard->generation;
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return entry;
+}
+
+/*
+ * Reads a file of size bytes, starting at start of fd, into a new entry,
+ * along with its validators, and returns it referenced. The entry is also
+ * added to the cache unless the resource was invalidated since
+ * objcache_lookup() handed out generation. Returns NULL
+ * if the file is too large to cache or cannot be read, in which case it
+ * should be sent from disk.
+ */
+struct obj_entry *objcache_load(const char *name,
+  unsigned generation,
+  int fd,
+  off_t start,
+  off_t size,
+  const char *etag,
+  time_t mtime,
+  const char *header,
+  int header_len)
+{
+    if(shard_budget == 0 || size > (off_t)max_object || strlen(name) >= sizeof(((struct obj_entry *)0)->name))
+        return NULL;
+
+    size_t cost = sizeof(struct obj_entry) + header_len + size;
+    struct obj_entry *entry = (struct obj_entry *)malloc(cost);
+    if(entry == NULL)
+        return NULL;
+
+    entry->header = (char *)(entry + 1);
+    entry->header_len = header_len;
+    entry->body = entry->header + header_len;
+    entry->body_len = size;
+    entry->cost = cost;
+    memcpy(entry->header, header, header_len);
+    strcpy(entry->name, name);
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    entry->mtime = mtime;
+
+    for(off_t offset = 0; offset < size;) {
+        ssize_t bytes_read = pread(fd, entry->body + offset, size - offset, start + offset);
+        if(bytes_read <= 0) { // the file changed under us, send it from disk
+            free(entry);
+            return NULL;
+        }
+        offset += bytes_read;
+    }
+
+    unsigned hash = hash_name(name);
+    struct shard *shard = &shards[hash % SHARDS];
+    entry->shard = hash % SHARDS;
+    entry->refs = 1;
+
+    struct obj_entry *dead = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    struct obj_entry *other = *bucket_of(shard, hash);
+    while(other != NULL && strcmp(other->name, name) != 0)
+        other = other->hash_next;
+
+    if(shard->generation == generation && other == NULL) {
+        entry->refs++; // the cache's reference
+        entry->hash_next = *bucket_of(shard, hash);
+        *bucket_of(shard, hash) = entry;
+        lru_push_front(shard, entry);
+        shard->bytes += cost;
+
+        // make room by dropping the least recently used entries
+        while(shard->bytes > shard_budget && shard->lru_tail != entry) {
+            struct obj_entry *evicted = remove_entry(shard, shard->lru_tail);
+            if(evicted) {
+                evicted->hash_next = dead;
+                dead = evicted;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    free_entries(dead);
+    return entry;
+}
+
+/*
+ * Gives back an entry from objcache_lookup() or objcache_load()
+ */
+void objcache_release(struct obj_entry *entry)
+{
+    struct shard *shard = &shards[entry->shard];
+    pthread_mutex_lock(&shard->mutex);
+    int last = --entry->refs == 0;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if(last)
+        free(entry);
+}
+
+/*
+ * Drops the cached copy of a resource that has been changed, and makes
+ * sure no GET that read the file before the change can put it back
+ */
+void objcache_invalidate(const char *name)
+{
+    if(shard_budget == 0)
+        return;
+
+    unsigned hash = hash_name(name);
+    struct shard *shard = &shards[hash % SHARDS];
+    struct obj_entry *dead = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->generation++;
+    struct obj_entry *entry = *bucket_of(shard, hash);
+    while(entry != NULL && strcmp(entry->name, name) != 0)
+        entry = entry->hash_next;
+    if(entry != NULL)
+        dead = remove_entry(shard, entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if(dead)
+        free(dead);
+}
+
+/*
+ * Drops everything, used when changes to the files may have been missed
+ */
+void objcache_clear()
+{
+    for(int i = 0; shard_budget > 0 && i < SHARDS; i++) {
+        struct shard *shard = &shards[i];
+        struct obj_entry *dead = NULL;
+
+        pthread_mutex_lock(&shard->mutex);
+        shard->generation++;
+        while(shard->lru_head != NULL) {
+            struct obj_entry *entry = remove_entry(shard, shard->lru_head);
+            if(entry) {
+                entry->hash_next = dead;
+                dead = entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        free_entries(dead);
+    }
+}
+
+/*
+ * Adds up the hit and miss counters of all shards
+ */
+void objcache_stats(unsigned long long *hits, unsigned long long *misses)
+{
+    *hits = *misses = 0;
+    for(int i = 0; shard_budget > 0 && i < SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        *hits += shards[i].hits;
+        *misses += shards[i].misses;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
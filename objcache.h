@@ -0,0 +1,41 @@
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * A small file held in memory together with the start of its 200 OK
+ * response, so a GET can be answered without touching the file system.
+ * Entries are read-only once made and stay valid while referenced.
+ */
+struct obj_entry {
+    char name[28];
+    int refs;
+    unsigned shard;
+    size_t cost;        // bytes charged against the cache budget
+    char *header;       // status line and Content-Length header
+    int header_len;
+    char *body;
+    size_t body_len;
+    char etag[64];      // validators of the version that was read
+    time_t mtime;
+    struct obj_entry *prev; // LRU list of the shard, most recent first
+    struct obj_entry *next;
+    struct obj_entry *hash_next;
+};
+
+void objcache_init(size_t bytes);
+int objcache_enabled();
+struct obj_entry *objcache_lookup(const char *name, unsigned *generation);
+struct obj_entry *objcache_load(const char *name,
+  unsigned generation,
+  int fd,
+  off_t start,
+  off_t size,
+  const char *etag,
+  time_t mtime,
+  const char *header,
+  int header_len);
+void objcache_release(struct obj_entry *entry);
+void objcache_invalidate(const char *name);
+void objcache_clear();
+void objcache_stats(unsigned long long *hits, unsigned long long *misses);
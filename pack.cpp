@@ -0,0 +1,527 @@
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "objcache.h"
+#include "pack.h"
+
+#define NAME_LEN 27
+#define PACK_DIR ".segments"
+#define INDEX_FILE PACK_DIR "/index"
+#define INDEX_MAGIC 0x31585049 // "IPX1"
+#define SEGMENT_SIZE (64 << 20) // a segment is sealed once it grows past this
+#define MAX_SEGMENTS 4096
+#define NO_SEGMENT UINT32_MAX   // marks an index slot whose object was removed
+#define COMPACT_INTERVAL 1      // seconds between looks for segments to compact
+
+/*
+ * The packed store appends small objects to a few large segment files in
+ * .segments instead of giving each of them a file, which spares the
+ * directory lookups and inodes of millions of tiny files. Segments are
+ * numbered and named by their number. One of them is active and takes new
+ * objects; the others are sealed and only read.
+ *
+ * Objects are found through a hash table kept in .segments/index and
+ * mapped into memory, so it is loaded at startup by mapping it rather than
+ * by reading it. A slot maps a name to the segment, offset and length of
+ * its object. Writing an object appends it to the active segment first and
+ * points its slot at it afterwards, so the index never names bytes that
+ * are not there yet.
+ *
+ * Replacing an object leaves its old bytes in their segment as dead space.
+ * A background thread looks at the sealed segments every second and moves
+ * the live objects out of a segment that is mostly dead into the active
+ * one, then deletes it. The segment fds handed out to GETs are duplicates,
+ * so a GET still sending from a deleted segment keeps it readable. Moved
+ * objects are dropped from the fd and object caches like replaced ones,
+ * or their cached duplicates would keep the deleted segment on disk.
+ */
+struct index_header {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t capacity; // slots, a power of two
+    uint64_t used;     // slots holding a name, removed objects included
+};
+
+struct index_slot {
+    char name[NAME_LEN + 1]; // empty in a free slot
+    uint32_t segment;        // NO_SEGMENT once the object was removed
+    uint64_t offset;
+    int64_t mtime_ns;        // when the object was stored
+    uint32_t length;
+};
+
+struct segment {
+    int fd;          // -1 if the number is free
+    off_t size;      // bytes appended or reserved so far
+    off_t live;      // bytes of objects the index points to
+    int pending;     // appends whose copy is not in the index yet
+};
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index_header *header; // the mapped index file
+static struct index_slot *slots;
+static int index_fd = -1;
+
+// segment fds and sizes change under the append mutex, live bytes under
+// the index lock
+static pthread_mutex_t append_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct segment segments[MAX_SEGMENTS];
+static int active = -1; // segment that takes new objects
+static unsigned long long compactions;
+
+/*
+ * FNV-1a hash of a resource name
+ */
+static unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for(; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static void segment_path(char *path, int size, int segment)
+{
+    snprintf(path, size, "%s/%08d", PACK_DIR, segment);
+}
+
+static struct index_slot *slot_of(struct index_slot *table, uint64_t capacity, const char *name)
+{
+    uint64_t slot = hash_name(name) & (capacity - 1);
+    while(table[slot].name[0] != '\0' && strcmp(table[slot].name, name) != 0)
+        slot = (slot + 1) & (capacity - 1);
+    return &table[slot];
+}
+
+/*
+ * Live slot of name, or NULL. The index lock must be held.
+ */
+static struct index_slot *lookup(const char *name)
+{
+    struct index_slot *slot = slot_of(slots, header->capacity, name);
+    if(slot->name[0] == '\0' || slot->segment == NO_SEGMENT)
+        return NULL;
+    return slot;
+}
+
+/*
+ * Maps an index file with room for capacity slots. A new file is set up
+ * empty.
+ */
+static void map_index(int fd, uint64_t capacity, int create)
+{
+    size_t size = sizeof(struct index_header) + capacity * sizeof(struct index_slot);
+    if(create && ftruncate(fd, size) < 0)
+        err(1, "%s", INDEX_FILE);
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        err(1, "%s", INDEX_FILE);
+
+    header = (struct index_header *)map;
+    slots = (struct index_slot *)(header + 1);
+    if(create) {
+        header->magic = INDEX_MAGIC;
+        header->capacity = capacity;
+        header->used = 0;
+    }
+}
+
+/*
+ * Moves the index into a file twice the size, leaving the removed objects
+ * behind. The index lock must be held for writing.
+ */
+static void grow_index()
+{
+    struct index_header *old_header = header;
+    struct index_slot *old_slots = slots;
+    int old_fd = index_fd;
+    uint64_t old_capacity = header->capacity;
+
+    const char *temp = INDEX_FILE ".new";
+    index_fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(index_fd < 0)
+        err(1, "%s", temp);
+    map_index(index_fd, old_capacity * 2, 1);
+
+    for(uint64_t i = 0; i < old_capacity; i++) {
+        if(old_slots[i].name[0] == '\0' || old_slots[i].segment == NO_SEGMENT)
+            continue;
+        *slot_of(slots, header->capacity, old_slots[i].name) = old_slots[i];
+        header->used++;
+    }
+
+    if(rename(temp, INDEX_FILE) < 0)
+        err(1, "%s", INDEX_FILE);
+    munmap(old_header, sizeof(struct index_header) + old_capacity * sizeof(struct index_slot));
+    close(old_fd);
+}
+
+/*
+ * Points name at a stored object, taking the bytes of the object it had
+ * before out of the live count of their segment. The index lock must be
+ * held for writing.
+ */
+static void index_set(const char *name, uint32_t segment, uint64_t offset, uint32_t length, int64_t mtime_ns)
+{
+    if((header->used + 1) * 10 > header->capacity * 7)
+        grow_index();
+
+    struct index_slot *slot = slot_of(slots, header->capacity, name);
+    if(slot->name[0] == '\0') {
+        strcpy(slot->name, name);
+        header->used++;
+    } else if(slot->segment != NO_SEGMENT) {
+        segments[slot->segment].live -= slot->length;
+    }
+
+    slot->offset = offset;
+    slot->length = length;
+    slot->mtime_ns = mtime_ns;
+    slot->segment = segment; // set last, so the slot never looks half made
+    if(segment != NO_SEGMENT)
+        segments[segment].live += length;
+}
+
+/*
+ * Opens a new segment and makes it the active one. The append mutex must
+ * be held. Returns -1 if every segment number is taken.
+ */
+static int start_segment()
+{
+    for(int segment = 0; segment < MAX_SEGMENTS; segment++) {
+        if(segments[segment].fd >= 0)
+            continue;
+
+        char path[32];
+        segment_path(path, sizeof(path), segment);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0)
+            return -1;
+        segments[segment].fd = fd;
+        segments[segment].size = 0;
+        segments[segment].live = 0;
+        segments[segment].pending = 0;
+        active = segment;
+        return 0;
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+/*
+ * Reserves length bytes at the end of the active segment. The caller
+ * copies the object there and then calls finish_append(). Returns the
+ * segment, or -1 with errno set.
+ */
+static int reserve(off_t length, off_t *offset)
+{
+    pthread_mutex_lock(&append_mutex);
+    if((active < 0 || segments[active].size + length > SEGMENT_SIZE) && start_segment() < 0) {
+        pthread_mutex_unlock(&append_mutex);
+        return -1;
+    }
+
+    int segment = active;
+    *offset = segments[segment].size;
+    segments[segment].size += length;
+    segments[segment].pending++;
+    pthread_mutex_unlock(&append_mutex);
+    return segment;
+}
+
+static void finish_append(int segment)
+{
+    pthread_mutex_lock(&append_mutex);
+    segments[segment].pending--;
+    pthread_mutex_unlock(&append_mutex);
+}
+
+/*
+ * Copies length bytes from offset in of in_fd to offset out of out_fd,
+ * inside the kernel where the file system allows it
+ */
+static int copy_range(int in_fd, off_t in, int out_fd, off_t out, off_t length)
+{
+    while(length > 0) {
+        ssize_t copied = copy_file_range(in_fd, &in, out_fd, &out, length, 0);
+        if(copied < 0 && errno == EINTR)
+            continue;
+        if(copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            break; // copy it by hand below
+        if(copied <= 0)
+            return -1;
+        length -= copied;
+    }
+
+    char buf[8192];
+    while(length > 0) {
+        ssize_t bytes_read = pread(in_fd, buf, length < (off_t)sizeof(buf) ? length : sizeof(buf), in);
+        if(bytes_read <= 0 || pwrite(out_fd, buf, bytes_read, out) != bytes_read)
+            return -1;
+        in += bytes_read;
+        out += bytes_read;
+        length -= bytes_read;
+    }
+
+    return 0;
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Moves the live objects of a sealed segment to the active one and deletes
+ * it. Objects that are replaced while they are being moved stay replaced.
+ */
+static void compact(int segment)
+{
+    // take a copy of the slots living in the segment, so the copying can
+    // go on without holding the index lock
+    pthread_rwlock_rdlock(&index_lock);
+    uint64_t capacity = header->capacity;
+    struct index_slot *moving = (struct index_slot *)malloc(capacity * sizeof(struct index_slot));
+    uint64_t count = 0;
+    for(uint64_t i = 0; moving != NULL && i < capacity; i++) {
+        if(slots[i].name[0] != '\0' && slots[i].segment == (uint32_t)segment)
+            moving[count++] = slots[i];
+    }
+    pthread_rwlock_unlock(&index_lock);
+    if(moving == NULL)
+        return;
+
+    for(uint64_t i = 0; i < count; i++) {
+        off_t offset;
+        int target = reserve(moving[i].length, &offset);
+        if(target < 0
+           || copy_range(segments[segment].fd, moving[i].offset, segments[target].fd, offset, moving[i].length) < 0) {
+            warn("Could not compact segment %d", segment);
+            if(target >= 0)
+                finish_append(target);
+            free(moving);
+            return;
+        }
+
+        pthread_rwlock_wrlock(&index_lock);
+        struct index_slot *slot = lookup(moving[i].name);
+        int moved = slot != NULL && slot->segment == (uint32_t)segment && slot->offset == moving[i].offset;
+        if(moved)
+            index_set(moving[i].name, target, offset, moving[i].length, moving[i].mtime_ns);
+        pthread_rwlock_unlock(&index_lock);
+        finish_append(target);
+
+        if(moved) {
+            fdcache_invalidate(moving[i].name);
+            objcache_invalidate(moving[i].name);
+        }
+    }
+    free(moving);
+
+    // the index lock keeps pack_open() from duplicating the fd meanwhile
+    pthread_rwlock_wrlock(&index_lock);
+    pthread_mutex_lock(&append_mutex);
+    if(segments[segment].live == 0 && segments[segment].pending == 0) {
+        char path[32];
+        segment_path(path, sizeof(path), segment);
+        unlink(path);
+        close(segments[segment].fd);
+        segments[segment].fd = -1;
+        compactions++;
+    }
+    pthread_mutex_unlock(&append_mutex);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/*
+ * Compacts sealed segments of which at least half is dead space
+ */
+static void *compact_segments(void *)
+{
+    for(;;) {
+        sleep(COMPACT_INTERVAL);
+
+        for(int segment = 0; segment < MAX_SEGMENTS; segment++) {
+            pthread_rwlock_rdlock(&index_lock);
+            pthread_mutex_lock(&append_mutex);
+            int worth = segments[segment].fd >= 0 && segment != active && segments[segment].pending == 0
+                        && segments[segment].live * 2 <= segments[segment].size;
+            pthread_mutex_unlock(&append_mutex);
+            pthread_rwlock_unlock(&index_lock);
+
+            if(worth)
+                compact(segment);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Opens the segments and maps the index in .segments, and starts the
+ * compaction thread
+ */
+void pack_init()
+{
+    if(mkdir(PACK_DIR, 0755) < 0 && errno != EEXIST)
+        err(1, "%s", PACK_DIR);
+
+    for(int segment = 0; segment < MAX_SEGMENTS; segment++)
+        segments[segment].fd = -1;
+
+    DIR *dir = opendir(PACK_DIR);
+    if(dir == NULL)
+        err(1, "%s", PACK_DIR);
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+        char *end;
+        long segment = strtol(ent->d_name, &end, 10);
+        if(strlen(ent->d_name) != 8 || *end != '\0' || segment < 0 || segment >= MAX_SEGMENTS)
+            continue;
+
+        char path[32];
+        segment_path(path, sizeof(path), segment);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) < 0)
+            err(1, "%s", path);
+        segments[segment].fd = fd;
+        segments[segment].size = st.st_size;
+    }
+    closedir(dir);
+
+    index_fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct index_header existing;
+    if(index_fd < 0)
+        err(1, "%s", INDEX_FILE);
+    if(pread(index_fd, &existing, sizeof(existing), 0) == sizeof(existing) && existing.magic == INDEX_MAGIC)
+        map_index(index_fd, existing.capacity, 0);
+    else
+        map_index(index_fd, 1024, 1);
+
+    // objects in segments that are gone, or that were never completely
+    // written, are dropped
+    for(uint64_t i = 0; i < header->capacity; i++) {
+        struct index_slot *slot = &slots[i];
+        if(slot->name[0] == '\0' || slot->segment == NO_SEGMENT)
+            continue;
+        if(slot->segment >= MAX_SEGMENTS || segments[slot->segment].fd < 0
+           || (off_t)(slot->offset + slot->length) > segments[slot->segment].size)
+            slot->segment = NO_SEGMENT;
+        else
+            segments[slot->segment].live += slot->length;
+    }
+
+    // segments nothing lives in any more
+    for(int segment = 0; segment < MAX_SEGMENTS; segment++) {
+        if(segments[segment].fd >= 0 && segments[segment].live == 0) {
+            char path[32];
+            segment_path(path, sizeof(path), segment);
+            unlink(path);
+            close(segments[segment].fd);
+            segments[segment].fd = -1;
+        }
+    }
+
+    pthread_t compactor;
+    if(pthread_create(&compactor, NULL, compact_segments, NULL) != 0)
+        err(1, "pthread_create");
+    pthread_detach(compactor);
+}
+
+/*
+ * Opens the object stored for name. Returns an fd of its segment, which
+ * the caller has to close, and sets *offset to where the object starts
+ * in it. st is filled in as if the object was a file of its own. Returns
+ * -1 with errno set to ENOENT if the object is not in the store.
+ */
+int pack_open(const char *name, struct stat *st, off_t *offset)
+{
+    int fd = -1;
+    errno = ENOENT;
+
+    pthread_rwlock_rdlock(&index_lock);
+    struct index_slot *slot = strlen(name) == NAME_LEN ? lookup(name) : NULL;
+    if(slot != NULL) {
+        fd = fcntl(segments[slot->segment].fd, F_DUPFD_CLOEXEC, 0);
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = slot->length;
+        st->st_mtim.tv_sec = slot->mtime_ns / 1000000000;
+        st->st_mtim.tv_nsec = slot->mtime_ns % 1000000000;
+        *offset = slot->offset;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    return fd;
+}
+
+/*
+ * Stores the first length bytes of fd, which may be at most
+ * PACK_MAX_OBJECT, as the object of name. Returns -1 with errno set if
+ * it could not be stored, in which case the old object is kept.
+ */
+int pack_store(const char *name, int fd, off_t length)
+{
+    off_t offset;
+    int segment = reserve(length, &offset);
+    if(segment < 0)
+        return -1;
+
+    if(copy_range(fd, 0, segments[segment].fd, offset, length) < 0) {
+        int error = errno;
+        finish_append(segment);
+        errno = error;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    index_set(name, segment, offset, length, now_ns());
+    pthread_rwlock_unlock(&index_lock);
+    finish_append(segment);
+    return 0;
+}
+
+/*
+ * Forgets the object of name, whose content is kept elsewhere now
+ */
+void pack_remove(const char *name)
+{
+    pthread_rwlock_wrlock(&index_lock);
+    if(lookup(name) != NULL)
+        index_set(name, NO_SEGMENT, 0, 0, 0);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void pack_stats(struct pack_usage *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+
+    pthread_rwlock_rdlock(&index_lock);
+    pthread_mutex_lock(&append_mutex);
+    for(int segment = 0; segment < MAX_SEGMENTS; segment++) {
+        if(segments[segment].fd < 0)
+            continue;
+        usage->segments++;
+        usage->live_bytes += segments[segment].live;
+        usage->dead_bytes += segments[segment].size - segments[segment].live;
+    }
+    usage->compactions = compactions;
+    pthread_mutex_unlock(&append_mutex);
+    pthread_rwlock_unlock(&index_lock);
+}
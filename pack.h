@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define PACK_MAX_OBJECT (64 << 10) // larger bodies are kept as plain files
+
+/*
+ * How the packed store uses its space
+ */
+struct pack_usage {
+    int segments;
+    unsigned long long live_bytes;
+    unsigned long long dead_bytes; // taken by objects that were replaced
+    unsigned long long compactions;
+};
+
+void pack_init();
+int pack_open(const char *name, struct stat *st, off_t *offset);
+int pack_store(const char *name, int fd, off_t length);
+void pack_remove(const char *name);
+void pack_stats(struct pack_usage *usage);
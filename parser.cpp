@@ -0,0 +1,210 @@
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+
+// states of the parser, in the order they are normally passed through
+enum {
+    S_METHOD,
+    S_RESOURCE,
+    S_VERSION,
+    S_REQUEST_LINE_LF,
+    S_HEADER_START,
+    S_HEADER_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_HEAD_END_LF,
+    S_DONE,
+    S_ERROR
+};
+
+/*
+ * Prepare a parser for a new request
+ */
+void parser_init(struct http_parser *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->state = S_METHOD;
+    parser->req.content_length = -1;
+}
+
+/*
+ * Compares a view to a string, ignoring case
+ */
+int view_equals(struct str_view view, const char *str)
+{
+    return (int)strlen(str) == view.len && !strncasecmp(view.data, str, view.len);
+}
+
+/*
+ * Parses a Content-Length value, returns -1 if it is not a number
+ */
+static long long parse_length(struct str_view value)
+{
+    long long length = 0;
+    if(value.len == 0 || value.len > 18) // keeps the result from overflowing
+        return -1;
+
+    for(int i = 0; i < value.len; i++) {
+        if(value.data[i] < '0' || value.data[i] > '9')
+            return -1;
+        length = length * 10 + (value.data[i] - '0');
+    }
+    return length;
+}
+
+/*
+ * Remembers the value of a header if it is one the server looks at.
+ * Returns -1 if the value is malformed.
+ */
+static int store_header(struct http_parser *parser, const char *buf, int value_end)
+{
+    struct str_view name = { buf + parser->name_start, parser->name_len };
+    struct str_view value = { buf + parser->mark, value_end - parser->mark };
+
+    // strip trailing whitespace, leading whitespace was never marked
+    while(value.len > 0 && (value.data[value.len - 1] == ' ' || value.data[value.len - 1] == '\t'))
+        value.len--;
+
+    if(view_equals(name, "Content-Length")) {
+        parser->req.content_length = parse_length(value);
+        if(parser->req.content_length < 0)
+            return -1;
+    } else if(view_equals(name, "Connection")) {
+        parser->req.connection = value;
+    } else if(view_equals(name, "Range")) {
+        parser->req.range = value;
+    } else if(view_equals(name, "If-None-Match")) {
+        parser->req.if_none_match = value;
+    } else if(view_equals(name, "If-Modified-Since")) {
+        parser->req.if_modified_since = value;
+    } else if(view_equals(name, "Transfer-Encoding")) {
+        parser->req.transfer_encoding = value;
+    }
+
+    return 0;
+}
+
+/*
+ * Looks at the bytes of buf that have not been parsed yet. Returns
+ * PARSE_DONE once the whole request head is in buf, PARSE_AGAIN if more
+ * bytes are needed, or PARSE_ERROR if the request is malformed. The views
+ * in parser->req point into buf.
+ */
+int parser_execute(struct http_parser *parser, const char *buf, int len)
+{
+    struct http_request *req = &parser->req;
+    int pos = parser->pos;
+    int state = parser->state;
+
+    for(; pos < len && state != S_DONE && state != S_ERROR; pos++) {
+        char ch = buf[pos];
+
+        switch(state) {
+            case S_METHOD:
+                if(ch == ' ') {
+                    req->method.data = buf + parser->mark;
+                    req->method.len = pos - parser->mark;
+                    parser->mark = pos + 1;
+                    state = req->method.len > 0 ? S_RESOURCE : S_ERROR;
+                } else if(ch == '\r' || ch == '\n') {
+                    state = S_ERROR;
+                }
+                break;
+
+            case S_RESOURCE:
+                if(ch == ' ' || ch == '\r' || ch == '\n') {
+                    req->resource.data = buf + parser->mark;
+                    req->resource.len = pos - parser->mark;
+                    parser->mark = pos + 1;
+                    if(ch == ' ')
+                        state = S_VERSION;
+                    else // no version, like HTTP/0.9
+                        state = ch == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+                }
+                break;
+
+            case S_VERSION:
+                if(ch == '\r' || ch == '\n') {
+                    req->version.data = buf + parser->mark;
+                    req->version.len = pos - parser->mark;
+                    state = ch == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+                } else if(ch == ' ') {
+                    state = S_ERROR;
+                }
+                break;
+
+            case S_REQUEST_LINE_LF:
+            case S_HEADER_LF:
+                state = ch == '\n' ? S_HEADER_START : S_ERROR;
+                break;
+
+            case S_HEADER_START:
+                if(ch == '\r') {
+                    state = S_HEAD_END_LF;
+                } else if(ch == '\n') {
+                    req->head_len = pos + 1;
+                    state = S_DONE;
+                } else if(ch == ':' || ch == ' ' || ch == '\t') {
+                    state = S_ERROR;
+                } else {
+                    parser->name_start = pos;
+                    state = S_HEADER_NAME;
+                }
+                break;
+
+            case S_HEADER_NAME:
+                // skip over the name in one go
+                while(ch != ':' && ch != '\r' && ch != '\n' && ch != ' ' && pos + 1 < len)
+                    ch = buf[++pos];
+
+                if(ch == ':') {
+                    parser->name_len = pos - parser->name_start;
+                    state = S_VALUE_START;
+                } else if(ch == '\r' || ch == '\n' || ch == ' ') {
+                    state = S_ERROR;
+                }
+                break;
+
+            case S_VALUE_START:
+                if(ch == ' ' || ch == '\t')
+                    break;
+                // this byte may already end the value
+                parser->mark = pos;
+                state = S_VALUE;
+                // fall through
+
+            case S_VALUE:
+                // skip over the value in one go
+                while(ch != '\r' && ch != '\n' && pos + 1 < len)
+                    ch = buf[++pos];
+
+                if(ch == '\r' || ch == '\n') {
+                    if(store_header(parser, buf, pos) < 0)
+                        state = S_ERROR;
+                    else
+                        state = ch == '\r' ? S_HEADER_LF : S_HEADER_START;
+                }
+                break;
+
+            case S_HEAD_END_LF:
+                if(ch == '\n') {
+                    req->head_len = pos + 1;
+                    state = S_DONE;
+                } else {
+                    state = S_ERROR;
+                }
+                break;
+        }
+    }
+
+    parser->pos = pos;
+    parser->state = state;
+
+    if(state == S_DONE)
+        return PARSE_DONE;
+    if(state == S_ERROR)
+        return PARSE_ERROR;
+    return PARSE_AGAIN;
+}
@@ -0,0 +1,52 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+// return values of parser_execute()
+#define PARSE_ERROR -1
+#define PARSE_AGAIN 0 // the request head is not complete yet
+#define PARSE_DONE 1
+
+/*
+ * A piece of the connection buffer. Views are not terminated.
+ */
+struct str_view {
+    const char *data;
+    int len;
+};
+
+/*
+ * The parts of a request head the server cares about. Headers that were
+ * not sent are left empty, and content_length is -1 when it is missing.
+ */
+struct http_request {
+    struct str_view method;
+    struct str_view resource;
+    struct str_view version;
+    struct str_view connection;
+    struct str_view range;
+    struct str_view if_none_match;
+    struct str_view if_modified_since;
+    struct str_view transfer_encoding;
+    long long content_length;
+    int head_len; // bytes up to and including the blank line
+};
+
+/*
+ * Resumable request head parser. It remembers how far it got, so it can
+ * be called again each time more bytes arrive in the same buffer, and
+ * never allocates memory.
+ */
+struct http_parser {
+    int state;
+    int pos;        // offset of the next byte to look at
+    int mark;       // offset where the current token started
+    int name_start; // offset of the current header name
+    int name_len;
+    struct http_request req;
+};
+
+void parser_init(struct http_parser *parser);
+int parser_execute(struct http_parser *parser, const char *buf, int len);
+int view_equals(struct str_view view, const char *str);
+
+#endif
@@ -0,0 +1,229 @@
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "queue.h"
+#include "stats.h"
+#include "worker.h"
+
+#define TICK_MS 100 // how often the manager looks at the queue
+
+/*
+ * The worker threads live in slots of an array sized for the largest the
+ * pool may get. A manager thread looks at the work queue every tick. When
+ * at least as many connections are waiting on it as there are workers,
+ * or every worker is busy and the connections taken since the last tick
+ * waited longer than grow_wait_us on average, it starts more workers in
+ * free slots, at most doubling the pool at a time. When workers have been
+ * spare and the queue empty for idle_seconds, it retires one per tick by
+ * putting the -2 poison pill on the queue, the same one the server quits
+ * with, so whichever worker is free next exits. A worker
+ * marks its slot when it exits and the manager joins it, after which the
+ * slot can be used again.
+ *
+ * Workers that accept on their own SO_REUSEPORT listener cannot be added
+ * or taken away, so with those the pool keeps its size.
+ */
+static struct worker *slots;
+static struct queue *work_queue;
+static struct pool_tuning tuning;
+static int pin_workers;
+
+static pthread_t manager;
+static int managing;
+static volatile int quitting;
+
+// only the manager changes these, so it may read them plainly, but
+// pool_stats() reads them from other threads, so they are written with
+// atomic stores
+static int target;    // workers wanted, those that have a pill coming not counted
+static int busy;      // workers serving a connection right now
+static int peak;
+static unsigned long long grown, shrunk;
+
+static void start_worker(int slot)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(pin_workers && cpus > 0) { // spread the workers over the cpus
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(slot % cpus, &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+
+    slots[slot].state = WORKER_RUNNING;
+    if(pthread_create(&slots[slot].thread, &attr, accept_job, &slots[slot]) != 0)
+        err(1, "pthread_create");
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Joins the workers that have taken a pill. Returns how many are still
+ * running.
+ */
+static int reap_workers()
+{
+    int running = 0;
+    for(int i = 0; i < tuning.max_workers; i++) {
+        int state = __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE);
+        if(state == WORKER_EXITED) {
+            pthread_join(slots[i].thread, NULL);
+            slots[i].state = WORKER_FREE;
+        } else if(state == WORKER_RUNNING) {
+            running++;
+        }
+    }
+    return running;
+}
+
+static void grow(int count, int depth, unsigned long long wait_us)
+{
+    int before = target;
+    for(int i = 0; i < tuning.max_workers && count > 0; i++) {
+        if(slots[i].state != WORKER_FREE)
+            continue;
+        start_worker(i);
+        __atomic_store_n(&target, target + 1, __ATOMIC_RELAXED);
+        count--;
+    }
+    if(target > peak)
+        __atomic_store_n(&peak, target, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&grown, 1, __ATOMIC_RELAXED);
+    printf("worker pool: %d -> %d workers, %d connections queued, %llu us mean wait\n",
+      before,
+      target,
+      depth,
+      wait_us);
+    fflush(stdout);
+}
+
+static void *manage_pool(void *)
+{
+    unsigned long long last_count = 0, last_sum = 0;
+    int idle_ticks = 0;
+    struct timespec tick = { 0, TICK_MS * 1000000L };
+
+    while(!quitting) {
+        nanosleep(&tick, NULL);
+        int running = reap_workers();
+
+        // how long the connections taken off the queue since the last tick
+        // waited on average
+        unsigned long long count, sum;
+        stats_histogram_totals(HIST_QUEUE_WAIT, &count, &sum);
+        unsigned long long wait_us = count > last_count ? (sum - last_sum) / (count - last_count) / 1000 : 0;
+        last_count = count;
+        last_sum = sum;
+
+        int depth = queue_depth(work_queue);
+        int working = __atomic_load_n(&busy, __ATOMIC_RELAXED);
+
+        if(target < tuning.max_workers
+           && (depth >= target || (working >= target && (long long)wait_us > tuning.grow_wait_us))) {
+            int more = depth > target ? target : depth > 0 ? depth : 1;
+            if(more > tuning.max_workers - target)
+                more = tuning.max_workers - target;
+            grow(more, depth, wait_us);
+            idle_ticks = 0;
+            continue;
+        }
+
+        if(depth == 0 && working < target)
+            idle_ticks++;
+        else
+            idle_ticks = 0;
+
+        // one pill at a time, and only once the last one has been taken
+        if(target > tuning.min_workers && running == target && idle_ticks * TICK_MS >= tuning.idle_seconds * 1000) {
+            enqueue(work_queue, -2);
+            __atomic_store_n(&target, target - 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&shrunk, 1, __ATOMIC_RELAXED);
+            printf("worker pool: %d -> %d workers, %d of them busy\n", target + 1, target, working);
+            fflush(stdout);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the minimum number of workers, and the manager if the pool may
+ * grow. Must be called with the signals the main thread takes masked.
+ */
+void pool_start(struct worker *workers, struct queue *queue, const struct pool_tuning *pool_tuning, int pin)
+{
+    slots = workers;
+    work_queue = queue;
+    tuning = *pool_tuning;
+    pin_workers = pin;
+
+    for(int i = 0; i < tuning.max_workers; i++)
+        slots[i].state = WORKER_FREE;
+    for(int i = 0; i < tuning.min_workers; i++)
+        start_worker(i);
+    __atomic_store_n(&target, tuning.min_workers, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak, tuning.min_workers, __ATOMIC_RELAXED);
+
+    if(tuning.max_workers > tuning.min_workers) {
+        if(pthread_create(&manager, NULL, manage_pool, NULL) != 0)
+            err(1, "pthread_create");
+        managing = 1;
+    }
+}
+
+/*
+ * Stops the manager and then every worker, and waits for all of them
+ */
+void pool_stop()
+{
+    if(managing) {
+        quitting = 1;
+        pthread_join(manager, NULL);
+    }
+
+    // count the workers before handing out any pill, as whichever worker
+    // is free takes it and may exit before its own slot is looked at. A
+    // worker that has a pill coming gets another one, which is harmless.
+    int pills = 0;
+    for(int i = 0; i < tuning.max_workers; i++) {
+        if(__atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE) != WORKER_RUNNING)
+            continue;
+        if(slots[i].listen_fd >= 0) // woken up by shutting its listener down
+            shutdown(slots[i].listen_fd, SHUT_RDWR);
+        else
+            pills++;
+    }
+    while(pills-- > 0)
+        enqueue(work_queue, -2);
+
+    for(int i = 0; i < tuning.max_workers; i++) {
+        if(slots[i].state != WORKER_FREE)
+            pthread_join(slots[i].thread, NULL);
+        slots[i].state = WORKER_FREE;
+    }
+}
+
+/*
+ * Workers call this with 1 when they take a connection and with -1 when
+ * they are done with it
+ */
+void pool_busy(int change)
+{
+    __atomic_add_fetch(&busy, change, __ATOMIC_RELAXED);
+}
+
+void pool_stats(struct pool_usage *usage)
+{
+    usage->workers = __atomic_load_n(&target, __ATOMIC_RELAXED);
+    usage->busy = __atomic_load_n(&busy, __ATOMIC_RELAXED);
+    usage->peak = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    usage->grown = __atomic_load_n(&grown, __ATOMIC_RELAXED);
+    usage->shrunk = __atomic_load_n(&shrunk, __ATOMIC_RELAXED);
+}
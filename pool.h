@@ -0,0 +1,27 @@
+struct worker;
+
+/*
+ * When the worker pool grows and shrinks
+ */
+struct pool_tuning {
+    int min_workers;
+    int max_workers;          // the pool never changes if this is min_workers
+    long long grow_wait_us;   // grow when connections wait this long on average
+    int idle_seconds;         // shrink when workers have been spare this long
+};
+
+/*
+ * What the pool has done so far
+ */
+struct pool_usage {
+    int workers; // running now
+    int busy;    // serving a connection now
+    int peak;
+    unsigned long long grown;
+    unsigned long long shrunk;
+};
+
+void pool_start(struct worker *workers, struct queue *queue, const struct pool_tuning *tuning, int pin);
+void pool_stop();
+void pool_busy(int change);
+void pool_stats(struct pool_usage *usage);
@@ -1,77 +1,226 @@
 #include <err.h>
-#include <iostream>
-#include <pthread.h>
+#include <linux/futex.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "queue.h"
 
-extern pthread_cond_t condl;
-extern pthread_mutex_t mutex;
+// how often a thread retries before it goes to sleep on a futex
+#define SPIN_TRIES 16
 
 /*
- * Initializes a new queue and returns it
+ * The queue is a ring of cells in the style of Dmitry Vyukov's bounded
+ * MPMC queue. Each cell carries a sequence number: a producer may fill the
+ * cell at position pos once seq == pos, and a consumer may empty it once
+ * seq == pos + 1. Producers and consumers claim positions with a
+ * compare-and-swap, so nobody ever holds a lock.
+ *
+ * Threads that find the queue empty (or full) sleep on a futex word that
+ * the other side bumps after every change, but only when somebody is known
+ * to be sleeping on it.
  */
-struct queue *new_queue()
+
+static void futex_wait(unsigned *addr, unsigned val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned *addr, int count)
 {
-    struct queue *queue = (struct queue *)malloc(sizeof(struct queue));
-    queue->first = NULL;
-    queue->last = NULL;
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * Initializes a new queue that holds up to capacity fds and returns it.
+ * The capacity is rounded up to a power of two.
+ */
+struct queue *new_queue(int capacity)
+{
+    unsigned size = 1;
+    while(size < (unsigned)capacity)
+        size <<= 1;
+
+    struct queue *queue;
+    if(posix_memalign((void **)&queue, CACHE_LINE, sizeof(struct queue)) != 0)
+        err(1, "new_queue");
+
+    queue->cells = (struct cell *)malloc(size * sizeof(struct cell));
+    if(queue->cells == NULL)
+        err(1, "new_queue");
+
+    for(unsigned i = 0; i < size; i++)
+        queue->cells[i].seq = i;
+
+    queue->mask = size - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->items = 0;
+    queue->idle_consumers = 0;
+    queue->space = 0;
+    queue->blocked_producers = 0;
     return queue;
 }
 
 /*
- * Add a new file descriptor to the queue
+ * Frees a queue made by new_queue()
  */
-void enqueue(queue *queue, int fd)
+void free_queue(queue *queue)
 {
-    struct node *new_node = (struct node *)malloc(sizeof(struct node));
-    new_node->fd = fd;
-    new_node->next = NULL;
-    pthread_mutex_lock(&mutex); // mutex lock: only one thread can add to the queue at once
-    if(queue->last == NULL) {
-        queue->first = new_node;
-        queue->last = new_node;
-    } else {
-        queue->last->next = new_node;
-        queue->last = new_node;
+    free(queue->cells);
+    free(queue);
+}
+
+/*
+ * Try to add fd to the queue, returns 0 if the queue is full
+ */
+static int try_enqueue(queue *queue, int fd)
+{
+    unsigned pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    for(;;) {
+        struct cell *cell = &queue->cells[pos & queue->mask];
+        unsigned seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - pos);
+
+        if(diff == 0) { // the cell is free, try to claim it
+            if(__atomic_compare_exchange_n(
+                 &queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->fd = fd;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if(diff < 0) { // a whole lap ahead of the consumers
+            return 0;
+        } else { // another producer took the cell, try the next one
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
     }
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&condl);
 }
 
 /*
- * Pop a file descriptor off of the queue
+ * Try to take an fd off the queue, returns 0 if the queue is empty
  */
-int dequeue(queue *queue)
+static int try_dequeue(queue *queue, int *fd)
 {
-    int fd;
+    unsigned pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    for(;;) {
+        struct cell *cell = &queue->cells[pos & queue->mask];
+        unsigned seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - (pos + 1));
 
-    pthread_mutex_lock(&mutex); // lock so only one thread can dequeue at once
+        if(diff == 0) { // the cell is filled, try to claim it
+            if(__atomic_compare_exchange_n(
+                 &queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *fd = cell->fd;
+                __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if(diff < 0) { // nothing has been added here yet
+            return 0;
+        } else { // another consumer took the cell, try the next one
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
 
-    while(queue_is_empty(queue)) {
-        printf("Worker thread %lu is waiting\n", pthread_self());
-        if(pthread_cond_wait(&condl, &mutex) != 0) {
-            err(1, NULL);
+/*
+ * Wake up one thread sleeping on a futex word, if there is any. The waker
+ * takes the sleeper off the count itself, so a thread that has not been
+ * scheduled yet is not woken again by every following change.
+ */
+static void wake_one(unsigned *word, unsigned *sleepers)
+{
+    // pairs with the fence in the sleeping thread: either it sees our change
+    // to the queue, or we see it counted in sleepers
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned count = __atomic_load_n(sleepers, __ATOMIC_RELAXED);
+    while(count > 0) {
+        if(__atomic_compare_exchange_n(
+             sleepers, &count, count - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+            futex_wake(word, 1);
+            return;
         }
     }
+}
+
+/*
+ * Sleep on a futex word until wake_one() is called for it. try_op is
+ * called once more after registering as a sleeper, so a change made in
+ * between is not missed. Returns 1 if try_op succeeded.
+ *
+ * A thread that succeeds on that last try stays on the count, because a
+ * waker may already have taken it off and taking it off twice could leave
+ * a real sleeper uncounted. The extra count only costs one futex_wake()
+ * that finds nobody.
+ */
+static int sleep_on(unsigned *word, unsigned *sleepers, int (*try_op)(queue *, int *), queue *queue, int *fd)
+{
+    unsigned val = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(try_op(queue, fd))
+        return 1;
 
-    struct node *tmp = queue->first;
-    fd = queue->first->fd;
-    free(tmp);
-    queue->first = queue->first->next;
+    futex_wait(word, val);
+    return 0;
+}
 
-    if(queue->first == NULL) {
-        queue->last = NULL;
+static int try_enqueue_fd(queue *queue, int *fd)
+{
+    return try_enqueue(queue, *fd);
+}
+
+/*
+ * Add a new file descriptor to the queue. If the queue is full this waits
+ * until a worker makes room.
+ */
+void enqueue(queue *queue, int fd)
+{
+    for(int tries = 0; !try_enqueue(queue, fd); tries++) {
+        if(tries >= SPIN_TRIES
+           && sleep_on(&queue->space, &queue->blocked_producers, try_enqueue_fd, queue, &fd))
+            break;
     }
-    pthread_mutex_unlock(&mutex);
 
+    wake_one(&queue->items, &queue->idle_consumers);
+}
+
+/*
+ * Pop a file descriptor off of the queue, sleeping while it is empty
+ */
+int dequeue(queue *queue)
+{
+    int fd;
+
+    for(int tries = 0; !try_dequeue(queue, &fd); tries++) {
+        if(tries >= SPIN_TRIES
+           && sleep_on(&queue->items, &queue->idle_consumers, try_dequeue, queue, &fd))
+            break;
+    }
+
+    wake_one(&queue->space, &queue->blocked_producers);
     return fd;
 }
 
 /*
- * Determien if a queue is empty
+ * Determine if a queue is empty
  */
 int queue_is_empty(queue *queue)
 {
-    return queue->first == NULL;
+    unsigned pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    struct cell *cell = &queue->cells[pos & queue->mask];
+    return (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0;
+}
+
+/*
+ * Number of fds waiting on the queue right now, which may be off by the
+ * ones being added or taken at the same time
+ */
+int queue_depth(queue *queue)
+{
+    unsigned enqueued = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    unsigned dequeued = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    return (int)(enqueued - dequeued) > 0 ? (int)(enqueued - dequeued) : 0;
 }
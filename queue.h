@@ -1,14 +1,33 @@
-struct node {
+#define CACHE_LINE 64
+
+/*
+ * One slot of the ring. seq tells producers and consumers whose turn it is
+ * to use the slot, see queue.cpp.
+ */
+struct cell {
+    unsigned seq;
     int fd;
-    struct node *next;
 };
 
+/*
+ * Bounded lock-free queue of file descriptors that any number of threads
+ * may add to and take from. The counters that different threads write are
+ * kept on separate cache lines.
+ */
 struct queue {
-    struct node *first;
-    struct node *last;
+    alignas(CACHE_LINE) unsigned enqueue_pos;
+    alignas(CACHE_LINE) unsigned dequeue_pos;
+    alignas(CACHE_LINE) unsigned items;     // futex bumped when an fd is added
+    unsigned idle_consumers;                // threads sleeping on items
+    alignas(CACHE_LINE) unsigned space;     // futex bumped when an fd is taken
+    unsigned blocked_producers;             // threads sleeping on space
+    alignas(CACHE_LINE) struct cell *cells;
+    unsigned mask; // capacity - 1
 };
 
-struct queue *new_queue();
+struct queue *new_queue(int capacity);
+void free_queue(queue *queue);
 void enqueue(queue *queue, int fd);
 int dequeue(queue *queue);
 int queue_is_empty(queue *queue);
+int queue_depth(queue *queue);
@@ -0,0 +1,92 @@
+#include <strings.h>
+
+#include "range.h"
+
+/*
+ * Reads the digits at *p, up to 18 of them so the number cannot overflow.
+ * Returns -1 if there are none.
+ */
+static long long parse_number(const char **p, const char *end)
+{
+    long long number = 0;
+    int digits = 0;
+    for(; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        if(++digits > 18)
+            return -1;
+        number = number * 10 + (**p - '0');
+    }
+    return digits > 0 ? number : -1;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while(p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+/*
+ * Works out which parts of a file of size bytes a Range header asks for.
+ * Returns how many ranges were put into ranges, 0 if the whole file should
+ * be sent because there is no usable header, or -1 if none of the ranges
+ * lie inside the file. A header that is malformed, uses another unit than
+ * bytes or asks for too many ranges counts as no header.
+ */
+int parse_ranges(struct str_view header, off_t size, struct byte_range *ranges)
+{
+    const char *p = header.data;
+    const char *end = header.data + header.len;
+    if(header.len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return 0;
+    p += 6;
+
+    int count = 0, specs = 0;
+    while(p < end) {
+        p = skip_space(p, end);
+        if(p < end && *p == ',') { // empty list elements are allowed
+            p++;
+            continue;
+        }
+
+        long long first, last;
+        if(p < end && *p == '-') { // the last n bytes
+            p++;
+            long long suffix = parse_number(&p, end);
+            if(suffix < 0)
+                return 0;
+            first = size - suffix < 0 ? 0 : size - suffix;
+            last = suffix > 0 ? size - 1 : -1;
+        } else {
+            first = parse_number(&p, end);
+            if(first < 0 || p >= end || *p != '-')
+                return 0;
+            p++;
+            last = size - 1;
+            if(p < end && *p >= '0' && *p <= '9') {
+                long long given = parse_number(&p, end);
+                if(given < 0 || given < first)
+                    return 0;
+                if(given < last)
+                    last = given;
+            }
+        }
+        specs++;
+
+        // ranges that start past the end of the file are left out
+        if(first <= last && first < size) {
+            if(count == MAX_RANGES)
+                return 0;
+            ranges[count].start = first;
+            ranges[count].end = last + 1;
+            count++;
+        }
+
+        p = skip_space(p, end);
+        if(p < end && *p != ',')
+            return 0;
+    }
+
+    if(specs == 0)
+        return 0;
+    return count > 0 ? count : -1;
+}
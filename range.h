@@ -0,0 +1,15 @@
+#include <sys/types.h>
+
+#include "parser.h"
+
+#define MAX_RANGES 16 // more ranges than this and the whole file is sent
+
+/*
+ * Bytes start up to, but not including, end of a file
+ */
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+int parse_ranges(struct str_view header, off_t size, struct byte_range *ranges);
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "reslock.h"
+
+/*
+ * PUTs of the same resource are serialized so that they publish their
+ * files, invalidate the caches and log in the same order. Resources are
+ * spread over stripes by the hash of their name. A stripe does not lock
+ * its resources as a whole; its mutex only guards the short list of
+ * names being written, so a PUT waits only for PUTs of the same name and
+ * unrelated resources on one stripe merely share that mutex for a moment.
+ * GETs never take these locks, since a PUT only replaces the file with a
+ * rename() once it is complete.
+ */
+struct stripe {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    struct res_lock *writers;
+    int waiting;
+    struct stripe_stats stats;
+} __attribute__((aligned(64)));
+
+static struct stripe stripes[RESLOCK_STRIPES];
+
+/*
+ * FNV-1a hash of a resource name
+ */
+static unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for(; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void reslock_init()
+{
+    for(int i = 0; i < RESLOCK_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].mutex, NULL);
+        pthread_cond_init(&stripes[i].released, NULL);
+    }
+}
+
+static int in_progress(struct stripe *stripe, const char *name)
+{
+    for(struct res_lock *writer = stripe->writers; writer != NULL; writer = writer->next) {
+        if(strcmp(writer->name, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Waits until no other PUT of name is in progress, then registers lock as
+ * the one that is
+ */
+void reslock_lock(struct res_lock *lock, const char *name)
+{
+    strncpy(lock->name, name, sizeof(lock->name) - 1);
+    lock->name[sizeof(lock->name) - 1] = '\0';
+    lock->stripe = hash_name(lock->name) % RESLOCK_STRIPES;
+    struct stripe *stripe = &stripes[lock->stripe];
+
+    pthread_mutex_lock(&stripe->mutex);
+    if(in_progress(stripe, lock->name)) {
+        unsigned long long start = now_ns();
+        stripe->stats.contended++;
+        stripe->waiting++;
+        do {
+            pthread_cond_wait(&stripe->released, &stripe->mutex);
+        } while(in_progress(stripe, lock->name));
+        stripe->waiting--;
+        stripe->stats.wait_ns += now_ns() - start;
+    }
+
+    lock->next = stripe->writers;
+    stripe->writers = lock;
+    stripe->stats.acquired++;
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+void reslock_unlock(struct res_lock *lock)
+{
+    struct stripe *stripe = &stripes[lock->stripe];
+
+    pthread_mutex_lock(&stripe->mutex);
+    struct res_lock **link = &stripe->writers;
+    while(*link != lock)
+        link = &(*link)->next;
+    *link = lock->next;
+
+    // waiters of other names on the stripe check again and go back to sleep
+    if(stripe->waiting > 0)
+        pthread_cond_broadcast(&stripe->released);
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+void reslock_stats(unsigned stripe, struct stripe_stats *stats)
+{
+    pthread_mutex_lock(&stripes[stripe].mutex);
+    *stats = stripes[stripe].stats;
+    pthread_mutex_unlock(&stripes[stripe].mutex);
+}
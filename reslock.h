@@ -0,0 +1,25 @@
+#define RESLOCK_STRIPES 64
+
+/*
+ * A PUT in progress on a resource. The caller provides the storage, so
+ * taking a lock never allocates.
+ */
+struct res_lock {
+    char name[28];
+    unsigned stripe;
+    struct res_lock *next; // other PUTs in progress on the same stripe
+};
+
+/*
+ * How busy one stripe of the lock table has been
+ */
+struct stripe_stats {
+    unsigned long long acquired;
+    unsigned long long contended; // times a PUT had to wait for another
+    unsigned long long wait_ns;   // total time spent waiting
+};
+
+void reslock_init();
+void reslock_lock(struct res_lock *lock, const char *name);
+void reslock_unlock(struct res_lock *lock);
+void reslock_stats(unsigned stripe, struct stripe_stats *stats);
@@ -0,0 +1,17 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+
+/*
+ * State of a SHA-256 hash that is fed its input in pieces
+ */
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    unsigned char block[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
@@ -0,0 +1,366 @@
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "objcache.h"
+#include "pool.h"
+#include "queue.h"
+#include "reslock.h"
+#include "stats.h"
+
+#define MAX_THREADS 256
+#define BUCKETS 32 // bucket b holds latencies below 2^b microseconds
+#define STATS_JSON "httpserver.stats.json"
+
+/*
+ * Every thread that serves requests owns a block of counters and only
+ * ever adds to its own, so counting takes no lock and no atomic
+ * read-modify-write, just a relaxed store that a reader on another thread
+ * can never see torn. A report adds the blocks of all threads up as they
+ * are at that moment. Threads that did not claim a block, like the event
+ * loop, share one and add to it atomically. The block of a thread that
+ * exits stays claimed until another thread takes it over, and its counts
+ * stay in the totals.
+ */
+struct thread_stats {
+    unsigned long long counters[STAT_COUNTERS];
+    unsigned long long statuses[16];
+    unsigned long long histograms[STAT_HISTOGRAMS][BUCKETS];
+    unsigned long long sums[STAT_HISTOGRAMS]; // nanoseconds, for the mean
+    int claimed;
+} __attribute__((aligned(64)));
+
+// the status codes the server sends, counted one by one
+static const int status_codes[] = { 200, 201, 206, 304, 400, 403, 404, 416, 500, 501 };
+#define STATUS_KINDS (int)(sizeof(status_codes) / sizeof(status_codes[0]))
+#define STATUS_OTHER STATUS_KINDS
+
+static const char *counter_names[STAT_COUNTERS] = { "get",
+    "put",
+    "other_method",
+    "bytes_in",
+    "bytes_out",
+    "fdcache_hits",
+    "fdcache_misses",
+    "uring_enters",
+    "idle_closed",
+    "evicted_header",
+    "evicted_body",
+    "evicted_send" };
+static const char *histogram_names[STAT_HISTOGRAMS] = { "queue_wait", "parse", "io", "total" };
+
+static struct thread_stats blocks[MAX_THREADS];
+static struct thread_stats shared; // threads without a block of their own
+static thread_local struct thread_stats *mine;
+static struct queue *work_queue;
+static unsigned long long *queued_at; // by fd, when the fd was queued
+static int queued_limit;
+
+void stats_init(struct queue *queue, int max_fds)
+{
+    work_queue = queue;
+    queued_limit = max_fds;
+    queued_at = (unsigned long long *)calloc(max_fds, sizeof(unsigned long long));
+    if(queued_at == NULL)
+        err(1, "stats_init");
+}
+
+/*
+ * Gives the calling thread a block of counters of its own
+ */
+void stats_thread_start()
+{
+    for(int i = 0; i < MAX_THREADS; i++) {
+        int unclaimed = 0;
+        if(__atomic_compare_exchange_n(&blocks[i].claimed, &unclaimed, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            mine = &blocks[i];
+            return;
+        }
+    }
+    // more threads than blocks, this one shares
+}
+
+void stats_thread_end()
+{
+    if(mine != NULL)
+        __atomic_store_n(&mine->claimed, 0, __ATOMIC_RELEASE);
+    mine = NULL;
+}
+
+static inline void bump(unsigned long long *counter, unsigned long long n)
+{
+    if(mine != NULL)
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline struct thread_stats *block()
+{
+    return mine != NULL ? mine : &shared;
+}
+
+void stats_add(enum stat_counter counter, unsigned long long n)
+{
+    bump(&block()->counters[counter], n);
+}
+
+void stats_status(int code)
+{
+    int kind = 0;
+    while(kind < STATUS_KINDS && status_codes[kind] != code)
+        kind++;
+    bump(&block()->statuses[kind], 1);
+}
+
+void stats_record(enum stat_histogram histogram, unsigned long long ns)
+{
+    unsigned long long us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if(bucket >= BUCKETS)
+        bucket = BUCKETS - 1;
+
+    struct thread_stats *stats = block();
+    bump(&stats->histograms[histogram][bucket], 1);
+    bump(&stats->sums[histogram], ns);
+}
+
+unsigned long long stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Remembers when fd was put on the work queue
+ */
+void stats_queued(int fd)
+{
+    if(fd >= 0 && fd < queued_limit)
+        queued_at[fd] = stats_now();
+}
+
+/*
+ * Records how long fd waited on the work queue and returns it
+ */
+unsigned long long stats_dequeued(int fd)
+{
+    if(fd < 0 || fd >= queued_limit || queued_at[fd] == 0)
+        return 0;
+
+    unsigned long long waited = stats_now() - queued_at[fd];
+    queued_at[fd] = 0;
+    stats_record(HIST_QUEUE_WAIT, waited);
+    return waited;
+}
+
+static void add_block(struct thread_stats *total, struct thread_stats *stats)
+{
+    for(int i = 0; i < STAT_COUNTERS; i++)
+        total->counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+    for(int i = 0; i <= STATUS_KINDS; i++)
+        total->statuses[i] += __atomic_load_n(&stats->statuses[i], __ATOMIC_RELAXED);
+    for(int h = 0; h < STAT_HISTOGRAMS; h++) {
+        total->sums[h] += __atomic_load_n(&stats->sums[h], __ATOMIC_RELAXED);
+        for(int b = 0; b < BUCKETS; b++)
+            total->histograms[h][b] += __atomic_load_n(&stats->histograms[h][b], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Number of samples of a histogram and their sum in nanoseconds, over all
+ * threads
+ */
+void stats_histogram_totals(enum stat_histogram histogram, unsigned long long *count, unsigned long long *sum_ns)
+{
+    *count = *sum_ns = 0;
+    for(int i = 0; i <= MAX_THREADS; i++) {
+        struct thread_stats *stats = i < MAX_THREADS ? &blocks[i] : &shared;
+        *sum_ns += __atomic_load_n(&stats->sums[histogram], __ATOMIC_RELAXED);
+        for(int b = 0; b < BUCKETS; b++)
+            *count += __atomic_load_n(&stats->histograms[histogram][b], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Upper bound in microseconds of the bucket holding the given fraction of
+ * the samples
+ */
+static unsigned long long percentile(const unsigned long long *buckets, unsigned long long count, double fraction)
+{
+    unsigned long long rank = (unsigned long long)(count * fraction), seen = 0;
+    for(int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if(seen > rank)
+            return 1ull << b;
+    }
+    return 1ull << (BUCKETS - 1);
+}
+
+/*
+ * Writes the totals over all threads into buf, as text or JSON. Returns
+ * the length, which is cut short if buf is too small.
+ */
+int stats_report(char *buf, int size, int json)
+{
+    struct thread_stats total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < MAX_THREADS; i++)
+        add_block(&total, &blocks[i]);
+    add_block(&total, &shared);
+
+    unsigned long long obj_hits = 0, obj_misses = 0;
+    if(objcache_enabled())
+        objcache_stats(&obj_hits, &obj_misses);
+    int depth = work_queue ? queue_depth(work_queue) : 0;
+    struct pool_usage pool;
+    pool_stats(&pool);
+
+    int len = 0;
+#define OUT(...) len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+    OUT(json ? "{\n  \"queue_depth\": %d,\n  \"objcache_hits\": %llu,\n  \"objcache_misses\": %llu"
+             : "queue depth %d\nobject cache hits %llu\nobject cache misses %llu\n",
+      depth,
+      obj_hits,
+      obj_misses);
+    OUT(json ? ",\n  \"workers\": %d,\n  \"workers_busy\": %d,\n  \"workers_peak\": %d,\n  \"pool_grown\": %llu,\n  "
+               "\"pool_shrunk\": %llu"
+             : "workers %d, %d busy, peak %d, pool grown %llu times, shrunk %llu times\n",
+      pool.workers,
+      pool.busy,
+      pool.peak,
+      pool.grown,
+      pool.shrunk);
+
+    // PUTs over all stripes of the resource locks, then the stripes where
+    // one had to wait for another
+    struct stripe_stats stripes[RESLOCK_STRIPES], locks;
+    memset(&locks, 0, sizeof(locks));
+    for(unsigned s = 0; s < RESLOCK_STRIPES; s++) {
+        reslock_stats(s, &stripes[s]);
+        locks.acquired += stripes[s].acquired;
+        locks.contended += stripes[s].contended;
+        locks.wait_ns += stripes[s].wait_ns;
+    }
+    OUT(json ? ",\n  \"reslock\": {\"acquired\": %llu, \"contended\": %llu, \"wait_us\": %llu, \"stripes\": {"
+             : "resource locks: %llu PUTs, %llu waited for %llu us in total\n",
+      locks.acquired,
+      locks.contended,
+      locks.wait_ns / 1000);
+    const char *comma = "";
+    for(unsigned s = 0; s < RESLOCK_STRIPES; s++) {
+        if(stripes[s].contended == 0)
+            continue;
+        OUT(json ? "%s\"%u\": {\"acquired\": %llu, \"contended\": %llu, \"wait_us\": %llu}"
+                 : "%sresource lock stripe %u: %llu PUTs, %llu waited for %llu us in total\n",
+          comma,
+          s,
+          stripes[s].acquired,
+          stripes[s].contended,
+          stripes[s].wait_ns / 1000);
+        if(json)
+            comma = ", ";
+    }
+    if(json)
+        OUT("}}");
+    for(int i = 0; i < STAT_COUNTERS; i++)
+        OUT(json ? ",\n  \"%s\": %llu" : "%s %llu\n", counter_names[i], total.counters[i]);
+
+    OUT(json ? ",\n  \"status\": {" : "status");
+    for(int i = 0; i <= STATUS_KINDS; i++) {
+        const char *separator = !json ? " " : i ? ", " : "";
+        if(i == STATUS_OTHER)
+            OUT(json ? "%s\"other\": %llu" : "%sother %llu", separator, total.statuses[i]);
+        else
+            OUT(json ? "%s\"%d\": %llu" : "%s%d %llu", separator, status_codes[i], total.statuses[i]);
+    }
+    OUT(json ? "}" : "\n");
+
+    for(int h = 0; h < STAT_HISTOGRAMS; h++) {
+        unsigned long long count = 0;
+        for(int b = 0; b < BUCKETS; b++)
+            count += total.histograms[h][b];
+        unsigned long long mean = count ? total.sums[h] / count / 1000 : 0;
+        unsigned long long p50 = count ? percentile(total.histograms[h], count, 0.5) : 0;
+        unsigned long long p99 = count ? percentile(total.histograms[h], count, 0.99) : 0;
+        unsigned long long p999 = count ? percentile(total.histograms[h], count, 0.999) : 0;
+
+        if(json) {
+            OUT(",\n  \"%s_us\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+                "\"buckets\": [",
+              histogram_names[h],
+              count,
+              mean,
+              p50,
+              p99,
+              p999);
+            for(int b = 0; b < BUCKETS; b++)
+                OUT("%s%llu", b ? ", " : "", total.histograms[h][b]);
+            OUT("]}");
+        } else {
+            OUT("%s: %llu samples, mean %llu us, p50 < %llu us, p99 < %llu us, p999 < %llu us\n",
+              histogram_names[h],
+              count,
+              mean,
+              p50,
+              p99,
+              p999);
+        }
+    }
+    if(json)
+        OUT("\n}\n");
+#undef OUT
+
+    return len < size ? len : size - 1;
+}
+
+/*
+ * Dumps the statistics each time SIGUSR1 arrives: as text to stdout and
+ * as JSON to httpserver.stats.json. All threads keep SIGUSR1 blocked, so
+ * it is only ever taken here.
+ */
+static void *dump_stats(void *)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    static char buf[16384];
+    for(;;) {
+        int signal;
+        if(sigwait(&set, &signal) != 0)
+            continue;
+
+        int len = stats_report(buf, sizeof(buf), 0);
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+
+        len = stats_report(buf, sizeof(buf), 1);
+        FILE *out = fopen(STATS_JSON, "w");
+        if(out == NULL) {
+            warn("%s", STATS_JSON);
+            continue;
+        }
+        fwrite(buf, 1, len, out);
+        fclose(out);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the thread answering SIGUSR1. The calling thread must have
+ * SIGUSR1 blocked.
+ */
+void stats_start_dumper()
+{
+    pthread_t dumper;
+    if(pthread_create(&dumper, NULL, dump_stats, NULL) != 0)
+        err(1, "pthread_create");
+    pthread_detach(dumper);
+}
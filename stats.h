@@ -0,0 +1,43 @@
+struct queue;
+
+// served by GET with -M, a name no file can have
+#define STATS_RESOURCE "/__stats"
+
+// counters kept by every thread
+enum stat_counter {
+    STAT_GET,
+    STAT_PUT,
+    STAT_OTHER_METHOD,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_FDCACHE_HITS,
+    STAT_FDCACHE_MISSES,
+    STAT_URING_ENTERS,
+    STAT_IDLE_CLOSED,  // in the order of the DEADLINE_* kinds in timer.h
+    STAT_EVICT_HEADER,
+    STAT_EVICT_BODY,
+    STAT_EVICT_SEND,
+    STAT_COUNTERS
+};
+
+// latencies kept as histograms
+enum stat_histogram {
+    HIST_QUEUE_WAIT, // from being queued by the accepting thread to a worker taking it
+    HIST_PARSE,      // parsing the request head
+    HIST_IO,         // answering the request, file I/O and sending included
+    HIST_TOTAL,      // all of the above
+    STAT_HISTOGRAMS
+};
+
+void stats_init(struct queue *queue, int max_fds);
+void stats_thread_start();
+void stats_thread_end();
+void stats_add(enum stat_counter counter, unsigned long long n);
+void stats_status(int code);
+void stats_record(enum stat_histogram histogram, unsigned long long ns);
+unsigned long long stats_now();
+void stats_queued(int fd);
+unsigned long long stats_dequeued(int fd);
+void stats_histogram_totals(enum stat_histogram histogram, unsigned long long *count, unsigned long long *sum_ns);
+int stats_report(char *buf, int size, int json);
+void stats_start_dumper();
@@ -0,0 +1,345 @@
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "store.h"
+
+#define NAME_LEN 27
+#define BLOB_DIR ".blobs"
+#define INDEX_FILE BLOB_DIR "/index"
+#define BLOB_PATH_LEN (sizeof(BLOB_DIR) + 2 * SHA256_DIGEST_LEN + 1)
+
+/*
+ * In the dedup store every distinct body is kept once, in a file under
+ * .blobs named by the SHA-256 of its content, and resources are mapped
+ * to those files by an index. A blob is never changed once written, so
+ * a GET can open whatever blob the index named when it looked and a PUT
+ * of the same content is just another index entry.
+ *
+ * The index lives in memory as an open addressing table and every change
+ * is appended to .blobs/index. At startup the journal is replayed and
+ * written back without the overwritten records, and blobs that no name
+ * refers to any more are removed. Blobs are only ever removed then, so a
+ * GET never has its blob disappear between looking it up and opening it.
+ */
+struct index_entry {
+    char name[NAME_LEN + 1]; // empty in a free slot
+    unsigned char digest[SHA256_DIGEST_LEN];
+};
+
+// what a change to the index looks like in the journal
+struct journal_record {
+    char name[NAME_LEN];
+    unsigned char digest[SHA256_DIGEST_LEN];
+} __attribute__((packed));
+
+static int mode;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index_entry *table;
+static size_t capacity; // a power of two
+static size_t count;
+static int journal_fd = -1;
+static unsigned long long duplicates; // PUTs whose body was already stored
+
+/*
+ * FNV-1a hash of a resource name
+ */
+static unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for(; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static struct index_entry *slot_of(const char *name)
+{
+    size_t slot = hash_name(name) & (capacity - 1);
+    while(table[slot].name[0] != '\0' && strcmp(table[slot].name, name) != 0)
+        slot = (slot + 1) & (capacity - 1);
+    return &table[slot];
+}
+
+static void index_grow()
+{
+    struct index_entry *old = table;
+    size_t old_capacity = capacity;
+
+    capacity = capacity ? capacity * 2 : 1024;
+    table = (struct index_entry *)calloc(capacity, sizeof(struct index_entry));
+    if(table == NULL)
+        err(1, "store index");
+
+    for(size_t i = 0; i < old_capacity; i++) {
+        if(old[i].name[0] != '\0')
+            *slot_of(old[i].name) = old[i];
+    }
+    free(old);
+}
+
+static void index_set(const char *name, const unsigned char *digest)
+{
+    // keep the table at most 70% full so probes stay short
+    if((count + 1) * 10 > capacity * 7)
+        index_grow();
+
+    struct index_entry *entry = slot_of(name);
+    if(entry->name[0] == '\0') {
+        strcpy(entry->name, name);
+        count++;
+    }
+    memcpy(entry->digest, digest, SHA256_DIGEST_LEN);
+}
+
+static void blob_path(char *path, const unsigned char *digest)
+{
+    char *out = path + sprintf(path, "%s/", BLOB_DIR);
+    for(int i = 0; i < SHA256_DIGEST_LEN; i++)
+        out += sprintf(out, "%02x", digest[i]);
+}
+
+static int compare_digests(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_DIGEST_LEN);
+}
+
+/*
+ * Replays the journal into the table
+ */
+static void load_index()
+{
+    int fd = open(INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        if(errno != ENOENT)
+            err(1, "%s", INDEX_FILE);
+        return;
+    }
+
+    struct journal_record record;
+    char name[NAME_LEN + 1];
+    while(read(fd, &record, sizeof(record)) == sizeof(record)) {
+        memcpy(name, record.name, NAME_LEN);
+        name[NAME_LEN] = '\0';
+        index_set(name, record.digest);
+    }
+    close(fd); // a torn last record is simply dropped
+}
+
+/*
+ * Writes the table as a fresh journal and opens it for appending
+ */
+static void rewrite_index()
+{
+    const char *temp = INDEX_FILE ".new";
+    FILE *out = fopen(temp, "w");
+    if(out == NULL)
+        err(1, "%s", temp);
+
+    struct journal_record record;
+    for(size_t i = 0; i < capacity; i++) {
+        if(table[i].name[0] == '\0')
+            continue;
+        memcpy(record.name, table[i].name, NAME_LEN);
+        memcpy(record.digest, table[i].digest, SHA256_DIGEST_LEN);
+        fwrite(&record, sizeof(record), 1, out);
+    }
+    if(fclose(out) != 0 || rename(temp, INDEX_FILE) < 0)
+        err(1, "%s", INDEX_FILE);
+
+    journal_fd = open(INDEX_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(journal_fd < 0)
+        err(1, "%s", INDEX_FILE);
+}
+
+/*
+ * Removes blobs no resource refers to any more
+ */
+static void collect_blobs()
+{
+    unsigned char *live = (unsigned char *)malloc(count * SHA256_DIGEST_LEN + 1);
+    if(live == NULL)
+        err(1, "store index");
+    size_t live_count = 0;
+    for(size_t i = 0; i < capacity; i++) {
+        if(table[i].name[0] != '\0')
+            memcpy(live + SHA256_DIGEST_LEN * live_count++, table[i].digest, SHA256_DIGEST_LEN);
+    }
+    qsort(live, live_count, SHA256_DIGEST_LEN, compare_digests);
+
+    DIR *dir = opendir(BLOB_DIR);
+    if(dir == NULL)
+        err(1, "%s", BLOB_DIR);
+
+    struct dirent *ent;
+    char path[BLOB_PATH_LEN];
+    unsigned char digest[SHA256_DIGEST_LEN];
+    while((ent = readdir(dir)) != NULL) {
+        if(strlen(ent->d_name) != 2 * SHA256_DIGEST_LEN)
+            continue;
+        int valid = 1;
+        for(int i = 0; i < SHA256_DIGEST_LEN && valid; i++)
+            valid = sscanf(ent->d_name + 2 * i, "%2hhx", &digest[i]) == 1;
+        if(valid && bsearch(digest, live, live_count, SHA256_DIGEST_LEN, compare_digests) == NULL) {
+            blob_path(path, digest);
+            unlink(path);
+        }
+    }
+
+    closedir(dir);
+    free(live);
+}
+
+/*
+ * Sets up the way resources are stored. The dedup store keeps its blobs
+ * and index in .blobs in the working directory, the packed store its
+ * segments in .segments.
+ */
+void store_init(int store_mode)
+{
+    mode = store_mode;
+    if(mode == STORE_PACKED)
+        pack_init();
+    if(mode != STORE_DEDUP)
+        return;
+
+    if(mkdir(BLOB_DIR, 0755) < 0 && errno != EEXIST)
+        err(1, "%s", BLOB_DIR);
+
+    index_grow();
+    load_index();
+    rewrite_index();
+    collect_blobs();
+}
+
+int store_mode()
+{
+    return mode;
+}
+
+static int open_file(const char *path, struct stat *st)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0 && fstat(fd, st) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Opens the content of resource name for reading and fills in st for it.
+ * The content starts at *offset of the returned fd, which is not the start
+ * of the file in the packed store. Returns -1 with errno set on an error.
+ * Resources the store has no entry for are looked for as plain files, so
+ * files from before it was enabled are still found.
+ */
+int store_open(const char *name, struct stat *st, off_t *offset)
+{
+    *offset = 0;
+
+    if(mode == STORE_PACKED) {
+        int fd = pack_open(name, st, offset);
+        if(fd >= 0 || errno != ENOENT)
+            return fd;
+    } else if(mode == STORE_DEDUP) {
+        unsigned char digest[SHA256_DIGEST_LEN];
+        int found = 0;
+
+        pthread_rwlock_rdlock(&index_lock);
+        if(strlen(name) == NAME_LEN) {
+            struct index_entry *entry = slot_of(name);
+            found = entry->name[0] != '\0';
+            if(found)
+                memcpy(digest, entry->digest, SHA256_DIGEST_LEN);
+        }
+        pthread_rwlock_unlock(&index_lock);
+
+        if(found) {
+            char path[BLOB_PATH_LEN];
+            blob_path(path, digest);
+            return open_file(path, st);
+        }
+    }
+
+    return open_file(name, st);
+}
+
+/*
+ * Makes the complete body in file temp, open as fd, the content of
+ * resource name. In the dedup store digest is the SHA-256 of the body, and
+ * temp is dropped if a blob with that content exists already. The packed
+ * store copies small bodies into a segment. Returns -1 with errno set if
+ * the body could not be stored, in which case temp is left alone.
+ */
+int store_publish(const char *name, const char *temp, int fd, const unsigned char *digest)
+{
+    if(mode == STORE_PACKED) {
+        struct stat st;
+        if(fstat(fd, &st) < 0)
+            return -1;
+
+        if(st.st_size > PACK_MAX_OBJECT) {
+            if(rename(temp, name) < 0)
+                return -1;
+            pack_remove(name); // the plain file is the content now
+            return 0;
+        }
+
+        if(pack_store(name, fd, st.st_size) < 0)
+            return -1;
+        unlink(temp);
+        unlink(name); // a plain file of the same name is out of date now
+        return 0;
+    }
+
+    if(mode != STORE_DEDUP)
+        return rename(temp, name);
+
+    // link() never replaces a blob, which could be open for a GET
+    char path[BLOB_PATH_LEN];
+    blob_path(path, digest);
+    int duplicate = 0;
+    if(link(temp, path) < 0) {
+        if(errno != EEXIST)
+            return -1;
+        duplicate = 1;
+    }
+    unlink(temp);
+
+    struct journal_record record;
+    memcpy(record.name, name, NAME_LEN);
+    memcpy(record.digest, digest, SHA256_DIGEST_LEN);
+
+    pthread_rwlock_wrlock(&index_lock);
+    index_set(name, digest);
+    duplicates += duplicate;
+    if(write(journal_fd, &record, sizeof(record)) != sizeof(record))
+        warn("Could not write to %s", INDEX_FILE);
+    pthread_rwlock_unlock(&index_lock);
+
+    // a plain file of the same name is out of date now
+    unlink(name);
+    return 0;
+}
+
+/*
+ * How many resources the dedup store knows, and how many PUTs it did not
+ * have to store a new blob for
+ */
+void store_stats(unsigned long long *names, unsigned long long *duplicate_puts)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    *names = count;
+    *duplicate_puts = duplicates;
+    pthread_rwlock_unlock(&index_lock);
+}
@@ -0,0 +1,14 @@
+#include <sys/stat.h>
+
+#include "sha256.h"
+
+// ways of keeping resources on disk
+#define STORE_FLAT 0  // one file per resource, named like it
+#define STORE_DEDUP 1 // one file per distinct body, found through an index
+#define STORE_PACKED 2 // small bodies appended to segment files, see pack.cpp
+
+void store_init(int mode);
+int store_mode();
+int store_open(const char *name, struct stat *st, off_t *offset);
+int store_publish(const char *name, const char *temp, int fd, const unsigned char *digest);
+void store_stats(unsigned long long *names, unsigned long long *duplicates);
@@ -0,0 +1,209 @@
+#include <err.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "stats.h"
+#include "timer.h"
+
+#define TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define LEVELS 4 // 64^4 ticks of 100 ms, about 19 days
+
+/*
+ * Hierarchical timer wheel for connection deadlines. Level 0 has a slot
+ * for each of the next 64 ticks, and every slot of level n covers a whole
+ * turn of level n - 1. A timer goes into the lowest level whose range
+ * reaches its expiry. Each time a level finishes a turn, the next slot of
+ * the level above is emptied and its timers are put back in, now into
+ * lower levels, so every timer is moved at most once per level. Arming and
+ * cancelling only link and unlink a list entry.
+ *
+ * A thread of its own advances the wheel every tick. When a connection's
+ * timer expires, the socket is shut down, which wakes whichever thread is
+ * blocked on it, a worker in read() or write() or epoll in event mode,
+ * and that thread closes the connection as if the client had gone away.
+ * Idle connections are closed gracefully, the others are reset.
+ * The owner cancels the timer before closing the fd, and expiry happens
+ * under the same mutex, so a timer never shuts down an fd that has been
+ * reused by another connection.
+ */
+static struct timer wheel[LEVELS][WHEEL_SIZE]; // list heads
+static unsigned long long now_tick;            // the next tick to run
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long expired[DEADLINES];
+
+static void unlink_timer(struct timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+static void insert(struct timer *timer)
+{
+    if(timer->expires < now_tick)
+        timer->expires = now_tick;
+
+    unsigned long long delta = timer->expires - now_tick;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= 1ull << (WHEEL_BITS * (level + 1)))
+        level++;
+    if(delta >> (WHEEL_BITS * LEVELS)) // further out than the wheel reaches
+        timer->expires = now_tick + (1ull << (WHEEL_BITS * LEVELS)) - 1;
+
+    struct timer *head = &wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/*
+ * Moves the timers of a slot of a higher level down
+ */
+static void cascade(int level, int index)
+{
+    struct timer *head = &wheel[level][index];
+    while(head->next != head) {
+        struct timer *timer = head->next;
+        unlink_timer(timer);
+        insert(timer);
+    }
+}
+
+static void run_tick()
+{
+    int index = now_tick & WHEEL_MASK;
+    for(int level = 1; index == 0 && level < LEVELS; level++) {
+        int upper = (now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        cascade(level, upper);
+        if(upper != 0)
+            break;
+    }
+
+    struct timer *head = &wheel[0][index];
+    while(head->next != head) {
+        struct timer *timer = head->next;
+        unlink_timer(timer);
+
+        // an evicted client gets a reset once the owner closes the fd,
+        // so what was queued for it is dropped instead of trickled out
+        if(timer->kind != DEADLINE_IDLE) {
+            struct linger linger = { 1, 0 };
+            setsockopt(timer->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+        shutdown(timer->fd, SHUT_RDWR);
+        expired[timer->kind]++;
+        stats_add((enum stat_counter)(STAT_IDLE_CLOSED + timer->kind), 1);
+    }
+    __atomic_store_n(&now_tick, now_tick + 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long long clock_ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000ull + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+static void *run_wheel(void *)
+{
+    unsigned long long start = clock_ticks();
+    struct timespec tick = { 0, TICK_MS * 1000000L };
+    for(;;) {
+        nanosleep(&tick, NULL);
+
+        // catch up on every tick that has passed, even if the sleep ran long
+        unsigned long long due = clock_ticks() - start;
+        pthread_mutex_lock(&wheel_mutex);
+        while(now_tick <= due)
+            run_tick();
+        pthread_mutex_unlock(&wheel_mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the thread that advances the wheel. The caller must have the
+ * signals the main thread takes masked.
+ */
+void timer_start()
+{
+    for(int level = 0; level < LEVELS; level++)
+        for(int i = 0; i < WHEEL_SIZE; i++)
+            wheel[level][i].next = wheel[level][i].prev = &wheel[level][i];
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, run_wheel, NULL) != 0)
+        err(1, "pthread_create");
+    pthread_detach(thread);
+}
+
+void timer_entry_init(struct timer *timer, int fd)
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->requested = 0;
+    timer->fd = fd;
+    timer->kind = DEADLINE_NONE;
+}
+
+/*
+ * Makes the timer expire in seconds, wherever it was armed before. 0
+ * seconds means no deadline.
+ */
+void timer_arm(struct timer *timer, int kind, int seconds)
+{
+    if(seconds <= 0) {
+        timer_cancel(timer);
+        timer->kind = kind; // remembered, so the owner knows what it waits for
+        timer->requested = 0;
+        return;
+    }
+
+    // re-arming within the same tick changes nothing, which spares the
+    // mutex when a transfer makes progress many times per tick. The wheel
+    // may clamp expires while it holds the lock, so the check is made on
+    // requested and kind, which only the owner ever writes.
+    unsigned long long ticks = seconds * (1000ull / TICK_MS);
+    unsigned long long requested = __atomic_load_n(&now_tick, __ATOMIC_RELAXED) + ticks;
+    if(timer->kind == kind && timer->requested == requested)
+        return;
+
+    pthread_mutex_lock(&wheel_mutex);
+    if(timer->next != NULL)
+        unlink_timer(timer);
+    timer->kind = kind;
+    timer->requested = now_tick + ticks;
+    timer->expires = timer->requested;
+    insert(timer);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+void timer_cancel(struct timer *timer)
+{
+    if(timer->kind == DEADLINE_NONE)
+        return;
+
+    pthread_mutex_lock(&wheel_mutex);
+    if(timer->next != NULL)
+        unlink_timer(timer);
+    timer->kind = DEADLINE_NONE;
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * How many connections were shut down because a deadline of the kind
+ * passed
+ */
+unsigned long long timer_expired(int kind)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    unsigned long long count = expired[kind];
+    pthread_mutex_unlock(&wheel_mutex);
+    return count;
+}
@@ -0,0 +1,31 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// what a connection is waiting for when its deadline passes
+#define DEADLINE_NONE -1
+#define DEADLINE_IDLE 0   // the next request on a kept-alive connection
+#define DEADLINE_HEADER 1 // the rest of a request head that has begun
+#define DEADLINE_BODY 2   // more of a request body
+#define DEADLINE_SEND 3   // the client taking more of the response
+#define DEADLINES 4
+
+/*
+ * An entry of the timer wheel, kept in every connection. Only the thread
+ * that owns the connection arms and cancels it.
+ */
+struct timer {
+    struct timer *next; // in a slot of the wheel, NULL when not armed
+    struct timer *prev;
+    unsigned long long expires;   // tick of the wheel, may be moved by the wheel
+    unsigned long long requested; // tick the owner last asked for
+    int fd;                       // shut down when the timer expires
+    int kind;                     // DEADLINE_* it was last armed for
+};
+
+void timer_start();
+void timer_entry_init(struct timer *timer, int fd);
+void timer_arm(struct timer *timer, int kind, int seconds);
+void timer_cancel(struct timer *timer);
+unsigned long long timer_expired(int kind);
+
+#endif
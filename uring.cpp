@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define RING_ENTRIES 16
+#define LOG_FILE 0 // index of the log among the registered files
+
+/*
+ * The rings are set up with the raw system calls, the layout is the one
+ * described in io_uring_setup(2).
+ */
+struct ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int has_log;
+    char *buffers;
+    int queued;  // operations in the current batch
+    int pending; // completions the current batch will produce
+};
+
+static thread_local struct ring ring; // set up while sq_ring is mapped
+static thread_local unsigned long long enters;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    enters++;
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Sets up the ring of the calling thread, registers its buffers, and the
+ * log as a fixed file if there is one. Returns -1 if the kernel does not
+ * support what is needed, in which case the caller uses plain system calls.
+ */
+int uring_init(int log_fd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(RING_ENTRIES, &params);
+    if(fd < 0)
+        return -1;
+
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // the submission and completion rings share one mapping
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(ring.cq_ring_size > ring.sq_ring_size)
+        ring.sq_ring_size = ring.cq_ring_size;
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring.sq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        if(ring.sq_ring != MAP_FAILED)
+            munmap(ring.sq_ring, ring.sq_ring_size);
+        if(ring.sqes != MAP_FAILED)
+            munmap(ring.sqes, ring.sqes_size);
+        ring.sq_ring = NULL;
+        close(fd);
+        return -1;
+    }
+
+    char *base = (char *)ring.sq_ring;
+    ring.sq_head = (unsigned *)(base + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(base + params.sq_off.array);
+    ring.cq_head = (unsigned *)(base + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring.fd = fd;
+
+    // registered buffers are pinned once instead of on every operation
+    struct iovec iov[URING_BUFFERS];
+    if(posix_memalign((void **)&ring.buffers, 4096, URING_BUFFERS * URING_BUFFER_SIZE) != 0) {
+        uring_exit();
+        errno = ENOMEM;
+        return -1;
+    }
+    for(int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = ring.buffers + i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if(io_uring_register(fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) {
+        uring_exit();
+        return -1;
+    }
+
+    ring.has_log = log_fd >= 0;
+    if(ring.has_log && io_uring_register(fd, IORING_REGISTER_FILES, &log_fd, 1) < 0) {
+        uring_exit();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Tears the ring of the calling thread down
+ */
+void uring_exit()
+{
+    if(ring.sq_ring == NULL)
+        return;
+
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+    free(ring.buffers);
+    ring.buffers = NULL;
+    ring.sq_ring = NULL;
+}
+
+int uring_active()
+{
+    return ring.sq_ring != NULL;
+}
+
+/*
+ * Returns one of the registered buffers of the calling thread, which are
+ * URING_BUFFER_SIZE bytes each
+ */
+char *uring_buffer(int index)
+{
+    return ring.buffers + index * URING_BUFFER_SIZE;
+}
+
+/*
+ * Takes the next submission entry and fills in what every operation has
+ */
+static struct io_uring_sqe *queue_op(int opcode, int fd, const void *buf, size_t len, off_t offset)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = ring.queued++;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    return sqe;
+}
+
+/*
+ * Queues accepting a connection on a listening socket
+ */
+void uring_accept(int fd)
+{
+    queue_op(IORING_OP_ACCEPT, fd, NULL, 0, 0);
+}
+
+/*
+ * Queues receiving from a socket. A client that stalls is cut off by its
+ * deadline in the timer wheel, which shuts the socket down, and the
+ * receive then completes with 0.
+ */
+void uring_recv(int fd, void *buf, size_t len)
+{
+    queue_op(IORING_OP_RECV, fd, buf, len, 0);
+}
+
+/*
+ * Queues writing from registered buffer index to a file at offset
+ */
+void uring_write_fixed(int fd, int index, const void *buf, size_t len, off_t offset)
+{
+    struct io_uring_sqe *sqe = queue_op(IORING_OP_WRITE_FIXED, fd, buf, len, offset);
+    sqe->buf_index = index;
+}
+
+/*
+ * Queues writing from registered buffer index to the log at offset
+ */
+void uring_write_log(int index, const void *buf, size_t len, off_t offset)
+{
+    struct io_uring_sqe *sqe = queue_op(IORING_OP_WRITE_FIXED, LOG_FILE, buf, len, offset);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->buf_index = index;
+}
+
+/*
+ * Submits everything queued since the last call and waits until it is all
+ * done, with one io_uring_enter() unless the wait is interrupted. The
+ * result of each operation goes into results in the order they were
+ * queued, a byte count or a negative errno value. Returns -1 if the ring
+ * itself failed, after which it is shut down.
+ */
+int uring_submit(int *results)
+{
+    unsigned to_submit = ring.pending;
+    unsigned remaining = ring.pending;
+    int status = 0;
+
+    while(remaining > 0) {
+        int submitted = io_uring_enter(ring.fd, to_submit, remaining, IORING_ENTER_GETEVENTS);
+        if(submitted < 0 && errno != EINTR) {
+            status = -1;
+            break;
+        }
+        if(submitted > 0)
+            to_submit -= submitted;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++, remaining--) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    ring.queued = 0;
+    ring.pending = 0;
+
+    // with operations of unknown state in flight the ring cannot be used
+    // again, the worker goes on with plain system calls
+    if(status < 0) {
+        int error = errno;
+        uring_exit();
+        errno = error;
+    }
+    return status;
+}
+
+/*
+ * Number of io_uring_enter() calls made by the calling thread
+ */
+unsigned long long uring_enters()
+{
+    return enters;
+}
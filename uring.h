@@ -0,0 +1,21 @@
+#include <sys/types.h>
+
+/*
+ * Optional io_uring backend (-U). Every worker thread gets a ring of its
+ * own. Operations are queued with the uring_* functions and then go to the
+ * kernel together in a single io_uring_enter() from uring_submit().
+ */
+
+#define URING_BUFFERS 3          // registered buffers of each worker
+#define URING_BUFFER_SIZE 65536
+
+int uring_init(int log_fd);
+void uring_exit();
+int uring_active();
+char *uring_buffer(int index);
+void uring_accept(int fd);
+void uring_recv(int fd, void *buf, size_t len);
+void uring_write_fixed(int fd, int index, const void *buf, size_t len, off_t offset);
+void uring_write_log(int index, const void *buf, size_t len, off_t offset);
+int uring_submit(int *results);
+unsigned long long uring_enters();
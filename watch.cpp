@@ -0,0 +1,65 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "objcache.h"
+#include "watch.h"
+
+#define NAME_LEN 27
+
+/*
+ * Watches the working directory and throws cached data out for files that
+ * are changed, replaced or removed by anything other than this server
+ */
+static void *watch_files(void *arg)
+{
+    int inotify_fd = (int)(long)arg;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t len = read(inotify_fd, events, sizeof(events));
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            warn("inotify");
+            return NULL;
+        }
+
+        for(char *p = events; p < events + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if(event->len > 0 && strlen(event->name) == NAME_LEN) {
+                fdcache_invalidate(event->name);
+                objcache_invalidate(event->name);
+            } else if(event->mask & IN_Q_OVERFLOW) { // events were lost, start over
+                fdcache_clear();
+                objcache_clear();
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/*
+ * Starts the thread keeping the fd and object caches in line with the
+ * files in the working directory
+ */
+void watch_start()
+{
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if(inotify_fd < 0
+       || inotify_add_watch(inotify_fd,
+            ".",
+            IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+              | IN_MOVED_TO)
+            < 0)
+        err(1, "inotify");
+
+    pthread_t watcher;
+    if(pthread_create(&watcher, NULL, watch_files, (void *)(long)inotify_fd) != 0)
+        err(1, "pthread_create");
+    pthread_detach(watcher);
+}
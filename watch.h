@@ -0,0 +1 @@
+void watch_start();
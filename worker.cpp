@@ -1,83 +1,270 @@
 #include <err.h>
+#include <errno.h>
 #include <iostream>
+#include <limits.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "conn.h"
+#include "event.h"
 #include "methods.h"
+#include "pool.h"
 #include "queue.h"
+#include "stats.h"
+#include "uring.h"
 #include "worker.h"
 
-#define BUF_SIZE 8000
+extern volatile sig_atomic_t listening;
+extern int event_mode;
+extern int max_requests;
+extern int uring_mode;
+extern int log_fd;
+extern int stats_endpoint;
 
-void *accept_job(void *queue)
+/*
+ * Reads more of a request from the client. This is only used without the
+ * event loop, where the worker blocks on the socket. Returns -1 if the
+ * connection has to be closed.
+ */
+static int read_more(struct conn *c)
 {
-    int fd;
-    int bytes_read;
-    struct queue *request_queue = (struct queue *)queue;
-    char buf[BUF_SIZE];
+    // an idle client may only keep the worker waiting for so long, and
+    // one that has begun a request head has to finish it in time however
+    // slowly its bytes trickle in
+    int kind = c->len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE;
+    if(c->deadline.kind != kind)
+        conn_deadline(c, kind);
+
+    if(uring_active()) {
+        int bytes_read = -EIO;
+        uring_recv(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+        if(uring_submit(&bytes_read) < 0)
+            bytes_read = -errno; // the ring is gone, the next read is a plain one
+        if(bytes_read <= 0) {
+            if(bytes_read < 0) {
+                errno = -bytes_read;
+                warn("Could not read from socket");
+            }
+            return -1;
+        }
+        c->len += bytes_read;
+        stats_add(STAT_BYTES_IN, bytes_read);
+        return 0;
+    }
 
     for(;;) {
-        fd = dequeue(request_queue);
-        if(fd == -2) { // recieved kill signal
-            break;
+        int bytes_read = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+        if(bytes_read > 0) {
+            c->len += bytes_read;
+            stats_add(STAT_BYTES_IN, bytes_read);
+            return 0;
         }
 
-        // read initial http request from the client
-        bytes_read = read(fd, buf, BUF_SIZE);
-        if(bytes_read == -1) {
-            warn("Could not read from socket");
+        if(bytes_read < 0 && errno == EINTR)
             continue;
+        if(bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            warn("Could not read from socket");
+        return -1;
+    }
+}
+
+/*
+ * Answers the request whose head the parser has just completed
+ */
+static void handle_request(struct conn *c)
+{
+    struct http_request *req = &c->parser.req;
+
+    // the body, if any, starts right after the head
+    c->start = req->head_len;
+
+    // the resource is always followed by another byte of the head, so it
+    // can be terminated in place for the file functions
+    char *resource = (char *)req->resource.data;
+    resource[req->resource.len] = '\0';
+
+    // HTTP/1.1 connections persist unless the client asks otherwise,
+    // HTTP/1.0 clients have to ask for it
+    if(view_equals(req->connection, "close"))
+        c->keep_alive = 0;
+    else if(view_equals(req->connection, "keep-alive"))
+        c->keep_alive = 1;
+    else
+        c->keep_alive = !view_equals(req->version, "HTTP/1.0");
+
+    c->requests++;
+    if(c->requests >= max_requests)
+        c->keep_alive = 0;
+
+    // the body of a request without one of the two framings that put()
+    // knows cannot be skipped, so the connection ends after the reply
+    int chunked = view_equals(req->transfer_encoding, "chunked");
+    if(req->transfer_encoding.len > 0 && !(chunked && view_equals(req->method, "PUT")))
+        c->keep_alive = 0;
+
+    if(req->content_length > INT_MAX) {
+        c->keep_alive = 0;
+        bad_request(c, "Content-Length too large");
+    } else if(req->transfer_encoding.len > 0 && req->content_length >= 0) {
+        // a body cannot be framed both ways at once
+        bad_request(c, "Both Transfer-Encoding and Content-Length");
+    } else if(req->transfer_encoding.len > 0 && !chunked) {
+        not_implemented(c, "Unsupported Transfer-Encoding");
+    } else if(view_equals(req->method, "GET")) {
+        stats_add(STAT_GET, 1);
+        if(stats_endpoint && strcmp(resource, STATS_RESOURCE) == 0) {
+            send_stats(c);
+            return;
         }
 
-        // terminate the data at the amount of bytes recieved from the client
-        buf[bytes_read] = '\0';
-
-        char *token1 = NULL;
-        char *saveptr1;
-        // we are using strtok here to split each line of the http
-        // request into a separate header to be processed individually
-        // in the while loop
-        token1 = strtok_r(buf, "\r\n", &saveptr1);
-
-        int content_length = -1; // -1 is a sentinel value for no content
-                                 // length supplied
-        char *resource = NULL;   // this variable will store the filename
-
-        while(token1 != NULL) {
-            char *token2 = NULL;
-            char *saveptr2;
-            // we are using strtok here to split each header of the http
-            // request by space, for example to split "Content-Length:" and "2"
-            token2 = strtok_r(token1, " ", &saveptr2);
-            while(token2 != NULL) {
-                if(!strcmp(token2, "GET") || !strcmp(token2, "PUT")) {
-                    resource = strtok_r(NULL, " ", &saveptr2);
-                }
-
-                if(!strcmp(token2, "Content-Length:")) {
-                    content_length = atoi(strtok_r(NULL, " ", &saveptr2));
-                }
-
-                token2 = strtok_r(NULL, " ", &saveptr2);
+        // if the user has given us a GET request, process in get()
+        printf("GET %s\n", resource);
+        get(c, resource);
+    } else if(view_equals(req->method, "PUT")) {
+        stats_add(STAT_PUT, 1);
+        // if the user has given us a PUT request, process in put()
+        printf("PUT %s\n", resource);
+        // send data to the put() function to be written to the disk
+        put(c, resource, req->content_length);
+    } else {
+        stats_add(STAT_OTHER_METHOD, 1);
+        // if not PUT or GET, reply with 400 Bad Request
+        c->keep_alive = 0;
+        bad_request(c, "Unsupported method");
+    }
+}
+
+/*
+ * Answers requests on a connection until it is closed. Pipelined requests
+ * that are already buffered are answered without reading the socket again.
+ * In event mode the connection goes back to the event loop as soon as no
+ * complete request is left in its buffer. waited is how long the connection
+ * sat on the work queue before this worker took it.
+ */
+static void serve_conn(struct conn *c, unsigned long long waited)
+{
+    unsigned long long parsing = 0; // time spent parsing the current request
+    for(;;) {
+        unsigned long long parse_start = stats_now();
+        int status = conn_parse(c);
+        parsing += stats_now() - parse_start;
+        if(status == PARSE_AGAIN && c->len < BUF_SIZE) {
+            if(event_mode) {
+                event_rearm(c);
+                return;
             }
 
-            token1 = strtok_r(NULL, "\r\n", &saveptr1);
+            if(read_more(c) < 0)
+                break;
+            continue;
+        }
+
+        if(status != PARSE_DONE) {
+            c->keep_alive = 0;
+            if(status == PARSE_ERROR)
+                bad_request(c, "Malformed request");
+            else // headers will never fit in the buffer
+                bad_request(c, "Request header too large");
+            break;
+        }
+
+        // the request has arrived, answering it sets deadlines of its own
+        timer_cancel(&c->deadline);
+
+        unsigned long long handle_start = stats_now();
+        handle_request(c);
+        unsigned long long handling = stats_now() - handle_start;
+        stats_record(HIST_PARSE, parsing);
+        stats_record(HIST_IO, handling);
+        stats_record(HIST_TOTAL, waited + parsing + handling);
+        waited = parsing = 0; // the next request on the connection was never queued
+        if(!c->keep_alive)
+            break;
+
+        conn_consume(c);
+    }
+
+    conn_close(c);
+}
+
+/*
+ * Accepts the next connection on the worker's own listener. Returns -2,
+ * like the poison pill on the queue, once the server is quitting.
+ */
+static int accept_own(struct worker *worker)
+{
+    for(;;) {
+        int fd;
+        if(uring_active()) {
+            uring_accept(worker->listen_fd);
+            if(uring_submit(&fd) < 0)
+                fd = -errno;
+            if(fd < 0)
+                errno = -fd;
+        } else {
+            fd = accept(worker->listen_fd, NULL, NULL);
+        }
+        if(fd >= 0)
+            return fd;
+
+        // main() shuts the listener down to wake us up when quitting
+        if(!listening)
+            return -2;
+
+        if(errno != EINTR && errno != ECONNABORTED)
+            warn("accept");
+    }
+}
+
+void *accept_job(void *arg)
+{
+    int fd;
+    struct worker *worker = (struct worker *)arg;
+    struct conn *c;
+    unsigned long long counted_enters = 0;
+
+    // main() has checked that the kernel supports io_uring, a worker that
+    // cannot get a ring anyway makes do with plain system calls
+    if(uring_mode && uring_init(log_fd) < 0)
+        warn("io_uring");
+    stats_thread_start();
+
+    for(;;) {
+        if(worker->listen_fd >= 0)
+            fd = accept_own(worker);
+        else
+            fd = dequeue(worker->queue);
+        if(fd == -2) { // recieved kill signal
+            break;
         }
+        unsigned long long waited = stats_dequeued(fd);
 
-        if(!strncmp("GET", buf, 3)) {
-            // if the user has given us a GET request, process in get()
-            printf("GET %s\n", resource);
-            get(fd, resource);
-        } else if(!strncmp("PUT", buf, 3)) {
-            // if the user has given us a PUT request, process in put()
-            printf("PUT %s\n", resource);
-            // send data to the put() function to be written to the disk
-            put(fd, resource, content_length);
+        if(event_mode) {
+            // the event loop has already buffered the whole request header
+            c = conn_lookup(fd);
         } else {
-            // if not PUT or GET, reply with 400 Bad Request
-            bad_request(fd, "Unsupported method");
+            c = conn_open(fd);
+            if(c == NULL) {
+                warnx("no connection slot for fd %d", fd);
+                close(fd);
+                continue;
+            }
         }
+
+        pool_busy(1);
+        serve_conn(c, waited);
+        pool_busy(-1);
+
+        // the ring counts its system calls per thread
+        unsigned long long enters = uring_enters();
+        stats_add(STAT_URING_ENTERS, enters - counted_enters);
+        counted_enters = enters;
     }
 
+    stats_thread_end();
+    uring_exit();
+    __atomic_store_n(&worker->state, WORKER_EXITED, __ATOMIC_RELEASE);
     return 0;
 }
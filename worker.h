@@ -1 +1,20 @@
-void *accept_job(void *queue);
+#include <pthread.h>
+
+struct queue;
+
+// what a slot of the worker pool holds
+#define WORKER_FREE 0
+#define WORKER_RUNNING 1
+#define WORKER_EXITED 2 // done, but not joined yet
+
+/*
+ * What main() hands to each worker thread
+ */
+struct worker {
+    pthread_t thread;
+    struct queue *queue; // where connections come from in the default mode
+    int listen_fd;       // the worker's own SO_REUSEPORT listener, or -1
+    int state;           // WORKER_FREE, WORKER_RUNNING or WORKER_EXITED
+};
+
+void *accept_job(void *worker);